@@ -0,0 +1,138 @@
+/*
+Rock-Paper-Scissors Binary Protocol
+
+Compact framing shared by game_server.cpp and load_tester.cpp. A client
+opts in by sending BINARY_PROTOCOL_MAGIC as the very first byte of the
+connection; anything else is the line-based text protocol (player.cpp).
+
+Frame: [1-byte opcode][varint payload length][payload]
+Varints are LEB128: 7 bits per byte, low bits first, high bit = more.
+
+*/
+
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Never the first byte of a UTF-8 text line
+const uint8_t BINARY_PROTOCOL_MAGIC = 0xFF;
+
+enum BinaryOp : uint8_t {
+    // Client -> server
+    BIN_HELLO = 0x01,           // payload: username (first frame)
+    BIN_JOIN = 0x02,
+    BIN_CHOICE = 0x03,          // payload: BinaryChoice
+    BIN_READY = 0x04,
+    BIN_QUIT = 0x05,
+
+    // Server -> client
+    BIN_WELCOME = 0x81,         // payload: varint rating
+    BIN_JOINED = 0x82,
+    BIN_MATCH_FOUND = 0x83,     // payload: varint opponent rating, opponent name
+    BIN_CHOICE_LOCKED = 0x84,
+    BIN_ROUND_RESULT = 0x85,    // payload: your choice, their choice, BinaryOutcome,
+                                //          your score, their score, flags (1 byte each)
+    BIN_NEW_ROUND = 0x86,
+    BIN_READY_WAITING = 0x87,
+    BIN_OPPONENT_LEFT = 0x88,   // payload: opponent name (you win by forfeit)
+    BIN_ERROR = 0x89,           // payload: BinaryError, your state (BinaryState)
+    BIN_GOODBYE = 0x8A,
+    BIN_TIMED_OUT = 0x8B,       // payload: BinaryTimeout (choice/ready also forfeit the match)
+    BIN_OPPONENT_TIMED_OUT = 0x8C,  // payload: opponent name (you win by forfeit)
+    BIN_MATCH_RESUMED = 0x8D,   // payload: your score, their score (1 byte each), opponent name
+                                // (a match cut off by a server crash carries on)
+};
+
+enum BinaryChoice : uint8_t { BIN_ROCK = 1, BIN_PAPER = 2, BIN_SCISSORS = 3 };
+enum BinaryOutcome : uint8_t { BIN_TIE = 0, BIN_WIN = 1, BIN_LOSS = 2 };
+const uint8_t BIN_FLAG_GAME_OVER = 0x01;    // ROUND_RESULT flags
+
+enum BinaryError : uint8_t {
+    BIN_ERR_WRONG_STATE = 1,    // command not valid right now
+    BIN_ERR_UNKNOWN_COMMAND = 2,
+};
+
+enum BinaryTimeout : uint8_t {
+    BIN_TIMEOUT_CHOICE = 1,
+    BIN_TIMEOUT_READY = 2,
+    BIN_TIMEOUT_QUEUE = 3,      // left the queue, can join again
+    BIN_TIMEOUT_IDLE = 4,       // connection is closed after this frame
+};
+
+// Player state in BIN_ERROR, same order as the server's PlayerState
+enum BinaryState : uint8_t {
+    BIN_STATE_CONNECTED = 0,
+    BIN_STATE_IN_QUEUE = 1,
+    BIN_STATE_CHOOSING = 2,
+    BIN_STATE_WAITING = 3,
+    BIN_STATE_VIEWING_RESULTS = 4,
+};
+
+// Largest payload either side accepts; names longer than BIN_MAX_NAME
+// are cut in server frames and refused in BIN_HELLO
+const uint32_t BIN_MAX_PAYLOAD = 512;
+const uint32_t BIN_MAX_NAME = 255;
+
+// Writes a varint into buf (at least 5 bytes), returns its length
+inline size_t encodeVarint(uint32_t value, char* buf) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (char)value;
+    return n;
+}
+
+// Reads a varint, returns the bytes used, 0 if more data is needed or -1 if malformed
+inline int decodeVarint(const char* data, size_t len, uint32_t& value) {
+    value = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        value |= (uint32_t)((uint8_t)data[i] & 0x7f) << (7 * i);
+        if (((uint8_t)data[i] & 0x80) == 0) {
+            return (int)i + 1;
+        }
+    }
+    return len >= 5 ? -1 : 0;
+}
+
+// Frame header (opcode + length) into buf (at least 6 bytes), returns its length
+inline size_t encodeFrameHeader(uint8_t op, uint32_t payload_len, char* buf) {
+    buf[0] = (char)op;
+    return 1 + encodeVarint(payload_len, buf + 1);
+}
+
+// Complete frame appended to out
+inline void appendFrame(std::string& out, uint8_t op, const char* payload, size_t len) {
+    char header[6];
+    out.append(header, encodeFrameHeader(op, (uint32_t)len, header));
+    out.append(payload, len);
+}
+
+// Splits the frame at the start of data: 1 and the parts when complete,
+// 0 if more bytes are needed, -1 if the frame is malformed or too big
+inline int parseFrame(const char* data, size_t len, uint8_t& op,
+                      const char*& payload, uint32_t& payload_len, size_t& frame_len) {
+    if (len < 2) {
+        return 0;
+    }
+    op = (uint8_t)data[0];
+    int used = decodeVarint(data + 1, len - 1, payload_len);
+    if (used <= 0) {
+        return used;
+    }
+    if (payload_len > BIN_MAX_PAYLOAD) {
+        return -1;
+    }
+    frame_len = 1 + used + payload_len;
+    if (len < frame_len) {
+        return 0;
+    }
+    payload = data + 1 + used;
+    return 1;
+}
+
+#endif
@@ -1,25 +1,55 @@
 /*
 Rock-Paper-Scissors Multiplayer Game Server
 
-A TCP-based game server that handles multiple concurrent players using select()
+A TCP-based game server that handles multiple concurrent players using epoll
 for I/O multiplexing. Features matchmaking, game state management, and graceful
 disconnect handling.
 
 Key Concepts Demonstrated:
 - Socket programming (TCP server implementation)
-- select() for handling multiple clients without threading
+- epoll for handling multiple clients without threading
+- Optional sharding: one independent event loop per thread (SO_REUSEPORT)
 - Game state machines (player states, game states)
 - Memory management (dynamic allocation of Player/Game objects)
  */
 
 #include <iostream>
 #include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <vector>
 #include <algorithm>
-#include <map>
+#include <unordered_map>
+#include <deque>
+#include <string_view>
+#include <charconv>
+#include <initializer_list>
+#include <new>
+#include <cmath>
+#include <chrono>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <csignal>
+#include "binary_protocol.h"
+#include "match_history.h"
 
 // ------------------- Enums -------------------
 
@@ -48,24 +78,282 @@ enum class Choice {
     SCISSORS
 };
 
+// Wire protocol a client picked with its first byte (see binary_protocol.h)
+enum class Protocol {
+    UNKNOWN,    // nothing received yet
+    TEXT,       // '\n'-terminated commands, player.cpp
+    BINARY,     // opcode + varint length frames
+    TEXT_UNFRAMED   // older text clients that send no '\n': each read is one command (see TimerKind::LINE_END)
+};
+
+// What a player's timer is waiting for (one timer per player, see TimingWheel)
+enum class TimerKind {
+    NONE,       // not armed
+    IDLE,       // any input, else the connection is closed
+    QUEUE,      // a match, else the player leaves the queue
+    CHOICE,     // rock/paper/scissors, else the match is forfeited
+    READY,      // 'ready', else the match is forfeited
+    LINE_END    // rest of a first line, else the client is taken as unframed (not a timeout, never counted)
+};
+
+// Log severity, WARNING and ERROR go to stderr
+enum class LogLevel {
+    DEBUG,      // every command received
+    INFO,       // connects, disconnects, matches
+    WARNING,
+    ERROR
+};
+
+// ------------------- Logging -------------------
+// Handlers never write to stdout themselves: each thread appends lines to
+// its own single-producer/single-consumer ring and a background writer
+// thread drains all rings with one write() per batch. A full ring drops the
+// line (counted and reported) instead of blocking the event loop.
+// Usage: LOG(INFO) << name << " disconnected";
+
+// Lines below this level are skipped without formatting (--log-level)
+LogLevel log_level = LogLevel::DEBUG;
+// Keep 1 in N lines per level (--log-sample LEVEL=N), 1 = all
+int log_sample_every[4] = {1, 1, 1, 1};
+
+struct LogRing {
+    static const size_t SLOTS = 4096;
+    static const size_t TEXT_SIZE = 248;   // longer lines are cut
+
+    struct Record {
+        LogLevel level;
+        uint32_t length;
+        char text[TEXT_SIZE];
+    };
+
+    Record records[SLOTS];
+    std::atomic<size_t> head{0};        // next record to drain (writer thread)
+    std::atomic<size_t> tail{0};        // next free record (owning thread)
+    std::atomic<uint64_t> dropped{0};
+
+    void push(LogLevel level, const std::string& line) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == SLOTS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Record& record = records[t % SLOTS];
+        record.level = level;
+        record.length = std::min(line.size(), TEXT_SIZE);
+        memcpy(record.text, line.data(), record.length);
+        tail.store(t + 1, std::memory_order_release);
+    }
+
+    // Appends every queued line to out (stdout) or err (stderr), false if empty
+    bool drain(std::string& out, std::string& err) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        for (size_t i = h; i != t; i++) {
+            Record& record = records[i % SLOTS];
+            std::string& target = record.level >= LogLevel::WARNING ? err : out;
+            target.append(record.text, record.length);
+            target += '\n';
+        }
+        head.store(t, std::memory_order_release);
+        return h != t;
+    }
+};
+
+std::vector<LogRing*> log_rings;   // one per thread that has logged
+std::mutex log_rings_lock;
+thread_local LogRing* thread_log_ring = nullptr;
+
+// Level and sampling check, done before the line is formatted
+inline bool logEnabled(LogLevel level) {
+    if (level < log_level) {
+        return false;
+    }
+    int every = log_sample_every[(int)level];
+    if (every > 1) {
+        static thread_local uint32_t counters[4] = {};
+        return counters[(int)level]++ % every == 0;
+    }
+    return true;
+}
+
+// Formats one line into a reused per-thread buffer, queued when it goes out of scope
+struct LogLine {
+    LogLevel level;
+    std::string& text;
+
+    explicit LogLine(LogLevel l) : level(l), text(buffer()) { text.clear(); }
+
+    ~LogLine() {
+        if (thread_log_ring == nullptr) {
+            thread_log_ring = new LogRing();
+            std::lock_guard<std::mutex> lock(log_rings_lock);
+            log_rings.push_back(thread_log_ring);
+        }
+        thread_log_ring->push(level, text);
+    }
+
+    static std::string& buffer() {
+        static thread_local std::string text;
+        return text;
+    }
+
+    LogLine& operator<<(const std::string& value) { text += value; return *this; }
+    LogLine& operator<<(std::string_view value) { text += value; return *this; }
+    LogLine& operator<<(const char* value) { text += value; return *this; }
+    LogLine& operator<<(char value) { text += value; return *this; }
+    template<typename T>
+    LogLine& operator<<(T value) { text += std::to_string(value); return *this; }
+};
+
+#define LOG(level) if (!logEnabled(LogLevel::level)) {} else LogLine(LogLevel::level)
+
+// Writes the whole buffer, false if the fd fails
+bool writeAll(int fd, const char* data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, data + written, len - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// "debug"/"info"/"warning"/"error" -> LogLevel value, -1 if unknown
+int parseLogLevel(const std::string& name) {
+    const char* names[] = {"debug", "info", "warning", "error"};
+    for (int i = 0; i < 4; i++) {
+        if (name == names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Background writer: drains every ring, one write() per stream per pass,
+// naps for a millisecond when there was nothing to write
+void logWriterLoop() {
+    std::string out, err;
+    std::vector<LogRing*> rings;
+    std::vector<uint64_t> reported_drops;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(log_rings_lock);
+            rings = log_rings;
+        }
+        reported_drops.resize(rings.size(), 0);
+
+        bool wrote = false;
+        for (size_t i = 0; i < rings.size(); i++) {
+            wrote |= rings[i]->drain(out, err);
+            uint64_t dropped = rings[i]->dropped.load(std::memory_order_relaxed);
+            if (dropped != reported_drops[i]) {
+                err += "Log ring full, dropped " + std::to_string(dropped - reported_drops[i]) + " line(s)\n";
+                reported_drops[i] = dropped;
+            }
+        }
+        if (!out.empty()) {
+            writeAll(STDOUT_FILENO, out.data(), out.size());
+            out.clear();
+        }
+        if (!err.empty()) {
+            writeAll(STDERR_FILENO, err.data(), err.size());
+            err.clear();
+        }
+        if (!wrote) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
 // ------------------- Structs -------------------
 
+struct Game;
+
+// Per-name profile, kept for the life of the server and persisted with
+// --stats FILE. A connected player works on its own copy, which is written
+// back when a match ends, so rounds never touch shared state
+const int DEFAULT_RATING = 1500;
+struct PlayerStats {
+    int32_t rating = DEFAULT_RATING;  // Elo
+    uint32_t wins = 0;                // matches (forfeits included)
+    uint32_t losses = 0;
+    uint32_t ties = 0;                // tied rounds
+    uint32_t choices[3] = {};         // rounds played with rock, paper, scissors
+};
+
+// A connection as the game logic sees it. Ids are handed out per shard
+// (released ones are reused first, so they stay small and dense like fds)
+// and only the transport behind a session knows what it is: a socket for
+// the epoll and io_uring backends, nothing at all when replaying a journal
+typedef int SessionId;
+
 // Connected player
 struct Player {
-    int socket;           // Socket file descriptor for player
+    SessionId session;    // Player's connection
     std::string name;     // Player's username
     PlayerState state;    // Current state in the game flow
+    Game* game;           // Current game, nullptr when not in one
+    uint32_t generation;  // connections[socket].generation while registered
+    Protocol protocol;    // text or binary, decided by the first byte received
+
+    PlayerStats stats;    // rating and record, looked up by name when the username arrives
+    uint32_t name_id;     // interned name in the match history (--history)
+
+    // Links in the matchmaking queue (intrusive, see PlayerQueue)
+    Player* queue_prev;
+    Player* queue_next;
+    bool in_queue;
+    int queue_bucket;     // MatchmakingQueue bucket while queued
+    std::chrono::steady_clock::time_point queued_at;
+    uint64_t resume_match;    // interrupted match waited for (see rejoinInterruptedMatch), 0 = none
+
+    // Timeout timer, linked into one TimingWheel slot while armed
+    Player* timer_prev;
+    Player* timer_next;
+    uint64_t timer_expires;   // wheel tick
+    int timer_slot;           // level * SLOTS + slot
+    TimerKind timer_kind;
+
+    // Bytes received but not yet a full command ('\n'-terminated line or
+    // binary frame); one read can carry several commands or only part of one
+    static const int INPUT_BUFFER_SIZE = 1024;
+    char input[INPUT_BUFFER_SIZE];
+    int input_len;
+    bool input_overflow;  // discarding a line longer than the buffer
+
+    // Replies not yet written to the socket (sockets are non-blocking, the
+    // backend writes what the kernel takes and the rest waits for writability)
+    std::string output;
+    size_t output_sent;   // bytes at the front of output already written
+    bool output_dirty;    // listed in dirty_outputs, flushed at the end of the loop iteration
+    bool closing;         // scheduled for disconnect at the end of the loop iteration
+
+    uint32_t pool_handle; // slot in player_pool
+
+    Player(SessionId id, std::string n)
+        : session(id), name(n), state(PlayerState::CONNECTED), game(nullptr), generation(0),
+          protocol(Protocol::UNKNOWN),
+          name_id(0), queue_prev(nullptr), queue_next(nullptr), in_queue(false), queue_bucket(0), resume_match(0),
+          timer_prev(nullptr), timer_next(nullptr), timer_expires(0), timer_slot(0), timer_kind(TimerKind::NONE),
+          input_len(0), input_overflow(false), output_sent(0), output_dirty(false),
+          closing(false) {}
 
-    Player(int sock, std::string n)
-        : socket(sock), name(n), state(PlayerState::CONNECTED) {}
+    size_t pendingOutput() const {
+        return output.size() - output_sent;
+    }
 };
 
 // Active game between two player
+// (players always outlive their game, so names are read through them
+// instead of being copied)
 struct Game {
-    int player1_socket;
-    int player2_socket;
-    std::string player1_name;
-    std::string player2_name;
+    Player* player1;
+    Player* player2;
 
     Choice choice1;
     Choice choice2;
@@ -76,16 +364,26 @@ struct Game {
 
     GameState state;
 
+    uint64_t match_id;    // match history id, set when the match starts
+    int round;            // rounds resolved so far
+
+    uint32_t pool_handle; // slot in game_pool
+
+    int snapshot_slot;    // index in snapshot_dirty_games, -1 = unchanged since the last copy
+    bool snapshot_known;  // the snapshot writer has it (and its names)
+
     Game (Player* p1, Player* p2)
-        : player1_socket(p1->socket),
-        player2_socket(p2->socket),
-        player1_name(p1->name),
-        player2_name(p2->name),
+        : player1(p1),
+        player2(p2),
         choice1(Choice::NONE),
         choice2(Choice::NONE),
         score1(0),
         score2(0),
-        state(GameState::ROUND_ACTIVE) {}
+        state(GameState::ROUND_ACTIVE),
+        match_id(0),
+        round(0),
+        snapshot_slot(-1),
+        snapshot_known(false) {}
 
     // Checks for both players making a choice
     bool bothChosen() {
@@ -117,517 +415,5245 @@ struct Game {
     }
 };
 
-// ------------------- Global State ------------------- 
-std::vector<int> matchmaking_queue; // players waiting for a match
-std::map<int, Game*> active_game;   // socket -> current game (both players point to same object)
-std::map<int, Player*> players;     // socket -> player object
+// FIFO of players waiting for a match. The links live in Player itself, so
+// joining, pairing off the front and leaving from the middle (disconnect)
+// are all O(1) and never allocate
+struct PlayerQueue {
+    Player* head = nullptr;
+    Player* tail = nullptr;
+    size_t count = 0;
 
+    size_t size() const { return count; }
+    Player* front() const { return head; }
 
-// ------------------- Helper Functions ------------------- 
+    void push(Player* player) {
+        player->queue_prev = tail;
+        player->queue_next = nullptr;
+        if (tail != nullptr) {
+            tail->queue_next = player;
+        } else {
+            head = player;
+        }
+        tail = player;
+        player->in_queue = true;
+        count++;
+    }
 
-// Sends message to both players
-void broadcast(const std::string& message, int socket1, int socket2) {
-    int sent1 = send(socket1, message.c_str(), message.length(), 0);
-    int sent2 = send(socket2, message.c_str(), message.length(), 0);
-}
+    void remove(Player* player) {
+        if (!player->in_queue) {
+            return;
+        }
+        if (player->queue_prev != nullptr) {
+            player->queue_prev->queue_next = player->queue_next;
+        } else {
+            head = player->queue_next;
+        }
+        if (player->queue_next != nullptr) {
+            player->queue_next->queue_prev = player->queue_prev;
+        } else {
+            tail = player->queue_prev;
+        }
+        player->queue_prev = nullptr;
+        player->queue_next = nullptr;
+        player->in_queue = false;
+        count--;
+    }
 
-// Convert string command to Choice enum
-Choice stringToChoice(const std::string& str) {
-    if(str == "rock") return Choice::ROCK;
-    if(str == "scissors") return Choice::SCISSORS;
-    if(str == "paper") return Choice::PAPER;
-    return Choice::NONE;
-}
+    Player* pop() {
+        Player* player = head;
+        if (player != nullptr) {
+            remove(player);
+        }
+        return player;
+    }
+};
 
-// Convert Choice enum to string for display
-std::string choiceToString(Choice c) {
-    if(c == Choice::ROCK) return "rock";
-    if(c == Choice::PAPER) return "paper";
-    if(c == Choice::SCISSORS) return "scissors";
-    return "none";
-}
+// Matchmaking index: queued players bucketed by rating, each bucket a FIFO.
+// Finding an opponent only looks at the buckets inside the rating window,
+// never at the whole queue
+struct MatchmakingQueue {
+    static const int BUCKET_WIDTH = 50;
+    static const int NUM_BUCKETS = 64;    // ratings 0-3199, outside that is clamped
 
-// Handles when player disconnects
-void handleDisconnect(int socket) {
-    // Gets player info before
-    if (players.find(socket) == players.end()) {
-        std::cout << "Warning: Tried to disconnect unknown socket " << socket << std::endl;
-        close(socket);
-        return;
+    PlayerQueue buckets[NUM_BUCKETS];
+    size_t count = 0;
+
+    size_t size() const { return count; }
+
+    static int bucketOf(int rating) {
+        return std::min(std::max(rating / BUCKET_WIDTH, 0), NUM_BUCKETS - 1);
     }
-    Player* player = players[socket];
-    std::string name = player->name.empty() ? "Unknown" : player->name;
 
-    std::cout << name << " (socket " << socket << ") disconnected" << std::endl;
+    void push(Player* player) {
+        player->queue_bucket = bucketOf(player->stats.rating);
+        buckets[player->queue_bucket].push(player);
+        count++;
+    }
 
-    // ---- CASE 1: Player in Queue ----
-    // removes from matchmaking queue
-    auto queue_position = std::find(matchmaking_queue.begin(), matchmaking_queue.end(), socket);
-    if (queue_position != matchmaking_queue.end()) {
-        matchmaking_queue.erase(queue_position);
-        std::cout << name << " removed from matchmaking queue" << std::endl;
+    void remove(Player* player) {
+        if (!player->in_queue) {
+            return;
+        }
+        buckets[player->queue_bucket].remove(player);
+        count--;
     }
 
-    // ---- CASE 2: Player in Active Game ----
-    
-    //Checks if player was in a game
-    if (active_game.find(socket) != active_game.end()) {
-        Game* game = active_game[socket];
-
-        // Finds the opponent socket
-        int opponent_socket;
-        std::string opponent_name;
-        if (socket == game->player1_socket) {
-            opponent_socket = game->player2_socket;
-            opponent_name = game->player2_name;
-        } else {
-            opponent_socket = game->player1_socket;
-            opponent_name = game->player1_name;
+    // Longest-waiting player of the lowest non-empty bucket (front() peeks, pop() takes it)
+    Player* front() const {
+        for (const PlayerQueue& bucket : buckets) {
+            if (bucket.size() > 0) {
+                return bucket.front();
+            }
+        }
+        return nullptr;
+    }
+
+    Player* pop() {
+        for (PlayerQueue& bucket : buckets) {
+            if (bucket.size() > 0) {
+                count--;
+                return bucket.pop();
+            }
         }
+        return nullptr;
+    }
+};
 
-        // Notify opponent of disconnect
-        if (players.find(opponent_socket) != players.end()) {
-            std::string msg = "\n--- OPPONENT DISCONNECTED ---\n";
-            // wins by forfeit
-            msg += "Your opponent, " + opponent_name + ", has left the game. You win by forfeit\n";
-            msg += "Type 'join' to find a new match\n";
-            
-            send(opponent_socket, msg.c_str(), msg.length(), 0);
+// Hierarchical timing wheel for the per-player timeouts. Level 0 has one
+// slot per tick, each level above covers 64 times the span of the one below
+// (4 levels: 64^4 ticks). Arming computes the slot from the expiry tick and
+// cancelling unlinks the player, both O(1). When the lower level wraps
+// around, the next slot up is re-inserted one level down, so every timer is
+// touched at most once per level before it fires
+struct TimingWheel {
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t MAX_DELAY = (1ull << (SLOT_BITS * LEVELS)) - 1;
 
-            // Reset opponent state to CONNECTED
-            Player* opponent = players[opponent_socket];
-            opponent->state = PlayerState::CONNECTED;
-            active_game.erase(opponent_socket);
+    Player* slots[LEVELS * SLOTS] = {};
+    uint64_t now_tick = 0;
+    size_t count = 0;
+
+    // Fires the timer on tick expires (at the earliest the next one)
+    void arm(Player* player, TimerKind kind, uint64_t expires) {
+        cancel(player);
+        player->timer_kind = kind;
+        player->timer_expires = std::min(std::max(expires, now_tick + 1), now_tick + MAX_DELAY);
+        insert(player);
+        count++;
+    }
+
+    void cancel(Player* player) {
+        if (player->timer_kind == TimerKind::NONE) {
+            return;
         }
-        
-        // Cleans up game object
-        active_game.erase(socket);
-        delete game;
-        std::cout << "Game cleaned up due to disconnect" << std::endl;
+        unlink(player);
+        player->timer_kind = TimerKind::NONE;
+        count--;
     }
 
-    // Ensures closing and erasing of player
-    close(socket);
-    delete player;
-    players.erase(socket);
-}
+    // Moves the wheel one tick forward, calls fire(player) for every timer
+    // that expires on it (the timer is already disarmed, kind passed along)
+    template<typename Fire>
+    void advance(Fire fire) {
+        now_tick++;
 
-// Validates if player is in state, sends error if not
-bool requireState(int socket, Player* player, PlayerState required_state) {
-    if (player->state != required_state) {
-        std::string msg;
-        
-        // Gives conextual messages to player
-        switch(player->state) {
-            case PlayerState::CONNECTED:
-                msg = "You're not in a game! Type 'join' to play.\n";
-                break;
-            case PlayerState::IN_QUEUE:
-                msg = "You're in queue. Please wait for a match.\n";
-                break;
-            case PlayerState::IN_GAME_CHOOSING:
-                msg = "Invalid command! Type: rock, paper, or scissors\n";
-                break;
-            case PlayerState::IN_GAME_WAITING:
-                msg = "Waiting for opponent to choose...\n";
-                break;
-            case PlayerState::VIEWING_RESULTS:
-                msg = "Type 'ready' for next round!\n";
+        // Cascades the slots whose span starts now one level down
+        for (int level = 1; level < LEVELS; level++) {
+            if ((now_tick & ((1ull << (SLOT_BITS * level)) - 1)) != 0) {
                 break;
+            }
+            int slot = level * SLOTS + ((now_tick >> (SLOT_BITS * level)) & (SLOTS - 1));
+            Player* player = slots[slot];
+            slots[slot] = nullptr;
+            while (player != nullptr) {
+                Player* next = player->timer_next;
+                insert(player);
+                player = next;
+            }
+        }
+
+        // Handlers may arm or cancel other timers, so re-reads the head each time
+        Player*& head = slots[now_tick & (SLOTS - 1)];
+        while (head != nullptr) {
+            Player* player = head;
+            TimerKind kind = player->timer_kind;
+            cancel(player);
+            fire(player, kind);
         }
-        
-        send(socket, msg.c_str(), msg.length(), 0);
-        return false;  // State check failed
     }
-    return true;  // State is correct
-}
 
-// Handles 'join' -> adds player to queue and match
-void handleJoinCommand(int socket, Player* player) {
-    player->state = PlayerState::IN_QUEUE;
-    matchmaking_queue.push_back(socket);
+    void insert(Player* player) {
+        uint64_t delta = player->timer_expires - now_tick;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        int slot = level * SLOTS + ((player->timer_expires >> (SLOT_BITS * level)) & (SLOTS - 1));
+        player->timer_slot = slot;
+        player->timer_prev = nullptr;
+        player->timer_next = slots[slot];
+        if (slots[slot] != nullptr) {
+            slots[slot]->timer_prev = player;
+        }
+        slots[slot] = player;
+    }
 
-    std::string msg = "Joined matchmaking queue. Waiting for opponent...\n";
-    send(socket, msg.c_str(), msg.length(), 0);
+    void unlink(Player* player) {
+        if (player->timer_prev != nullptr) {
+            player->timer_prev->timer_next = player->timer_next;
+        } else {
+            slots[player->timer_slot] = player->timer_next;
+        }
+        if (player->timer_next != nullptr) {
+            player->timer_next->timer_prev = player->timer_prev;
+        }
+        player->timer_prev = nullptr;
+        player->timer_next = nullptr;
+    }
+};
 
-    // Tries to match players if 2+ in queue, create a match
-    if (matchmaking_queue.size() >= 2)
-    {
-        // Gets the first two players
-        int p1_sock = matchmaking_queue[0];
-        int p2_sock = matchmaking_queue[1];
+// Stats per player name, shared by all shards. Only touched when a
+// username arrives and when a match ends, never per round
+std::unordered_map<std::string, PlayerStats> player_stats;
+std::mutex stats_lock;
 
-        Player *p1 = players[p1_sock];
-        Player *p2 = players[p2_sock];
+// ------------------- Object Pools -------------------
 
-        // Creates new game
-        Game *game = new Game(p1, p2);
-        active_game[p1_sock] = game;
-        active_game[p2_sock] = game;
+// Fixed-size slab allocator for Player and Game: objects live in slabs of
+// SLAB_SIZE slots that are never freed, and released slots go on a free list
+// and are reused first. Once the pool has grown to the peak load, creating
+// and destroying objects never calls malloc. The handle (slot index) stored
+// in the object's pool_handle stays valid for the object's whole lifetime
+template <typename T>
+struct ObjectPool {
+    static const uint32_t SLAB_SIZE = 256;
 
-        // Updates states
-        p1->state = PlayerState::IN_GAME_CHOOSING;
-        p2->state = PlayerState::IN_GAME_CHOOSING;
+    struct Slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
 
-        // Remove players from queue
-        matchmaking_queue.erase(matchmaking_queue.begin(), matchmaking_queue.begin() + 2);
+    const char* name;
+    std::vector<Slot*> slabs;
+    std::vector<uint32_t> free_list;  // reserved for every slot, so pushes never reallocate
 
-        // Notify both players
-        std::string match_msg = "\n--- MATCH FOUND ---\n";
-        match_msg += "Playing against: ";
+    // Allocation stats
+    size_t live = 0;            // objects currently in use
+    size_t peak = 0;            // most objects in use at once
+    size_t total_created = 0;   // create() calls, reused slots included
 
-        std::string p1_msg = match_msg + p2->name + "\n";
-        p1_msg += "Choose: rock, paper, or scissors\n";
-        send(p1_sock, p1_msg.c_str(), p1_msg.length(), 0);
+    explicit ObjectPool(const char* pool_name) : name(pool_name) {}
 
-        std::string p2_msg = match_msg + p1->name + "\n";
-        p2_msg += "Choose: rock, paper, or scissors\n";
-        send(p2_sock, p2_msg.c_str(), p2_msg.length(), 0);
+    ~ObjectPool() {
+        for (Slot* slab : slabs) {
+            delete[] slab;
+        }
     }
-}
 
-// Handles rock/paper/scissors choice -> stores choice and checks for both chosen
-void handleChoiceCommand(int socket, Player* player, const std::string& command) {
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (free_list.empty()) {
+            grow();
+        }
+        uint32_t handle = free_list.back();
+        free_list.pop_back();
 
-    Game *game = active_game[socket];
-    Choice choice = stringToChoice(command);
+        T* object = new (slot(handle)) T(std::forward<Args>(args)...);
+        object->pool_handle = handle;
 
-    // Stores choice based on player
-    if (socket == game->player1_socket)
-    {
-        game->choice1 = choice;
+        live++;
+        total_created++;
+        peak = std::max(peak, live);
+        return object;
+    }
 
-        player->state = PlayerState::IN_GAME_WAITING;
-        std::string msg_player = "Choice locked in! Waiting for opponent...\n";
-        send(socket, msg_player.c_str(), msg_player.length(), 0);
+    void destroy(T* object) {
+        uint32_t handle = object->pool_handle;
+        object->~T();
+        free_list.push_back(handle);
+        live--;
     }
-    else
-    {
-        game->choice2 = choice;
 
-        player->state = PlayerState::IN_GAME_WAITING;
-        std::string msg_player = "Choice locked in! Waiting for opponent...\n";
-        send(socket, msg_player.c_str(), msg_player.length(), 0);
+    T* get(uint32_t handle) {
+        return (T*)slot(handle);
     }
 
-    // if both players have chosen, resolves the current round
-    if (game->bothChosen())
-    {
-        // Determines who won
-        int winner = game->getRoundWinner();
+    void* slot(uint32_t handle) {
+        return slabs[handle / SLAB_SIZE][handle % SLAB_SIZE].storage;
+    }
 
-        // Updates scores
-        if (winner == 1)
-            game->score1++;
-        if (winner == 2)
-            game->score2++;
+    // Adds one slab, lowest handles are handed out first
+    void grow() {
+        uint32_t first = slabs.size() * SLAB_SIZE;
+        slabs.push_back(new Slot[SLAB_SIZE]);
+        free_list.reserve(slabs.size() * SLAB_SIZE);
+        for (uint32_t handle = first + SLAB_SIZE; handle > first; handle--) {
+            free_list.push_back(handle - 1);
+        }
+        LOG(INFO) << name << " pool grew to " << slabs.size() << " slab(s) (" << live << " live, peak "
+                  << peak << ", " << total_created << " created)";
+    }
+};
 
-        game->state = GameState::ROUND_COMPLETE;
+// ------------------- Profiling -------------------
+// Built with -DGAME_PROFILING: per-shard latency histograms for the command
+// handlers, the event wait and socket sends. `kill -USR1 <pid>` prints a
+// snapshot while the server keeps running. Without the flag PROFILE_SCOPE
+// expands to nothing and none of this is compiled
 
-        // Build result message
-        std::string result = "\n--- ROUND RESULT ---\n";
-        result += game->player1_name + " chose: " + choiceToString(game->choice1) + "\n";
-        result += game->player2_name + " chose: " + choiceToString(game->choice2) + "\n";
+#ifdef GAME_PROFILING
+enum ProfilePoint {
+    PROFILE_JOIN, PROFILE_CHOICE, PROFILE_READY, PROFILE_DISCONNECT,
+    PROFILE_REQUIRE_STATE, PROFILE_WAIT, PROFILE_SEND, PROFILE_POINTS
+};
+const char* profile_point_names[PROFILE_POINTS] = {
+    "handleJoinCommand", "handleChoiceCommand", "handleReadyCommand", "handleDisconnect",
+    "requireState", "event wait", "send"
+};
 
-        if (winner == 0)
-        {
-            result += "It's a TIE!\n";
+// Log-bucketed histogram of nanoseconds (HDR style): one bucket group per
+// power of two, split into 8 linear sub-buckets, so every value is kept
+// within 12.5% at a fixed 4 KB. Only the owning shard writes; counters are
+// atomics so the dump can read them from another thread without a lock
+struct LatencyHistogram {
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 62 * SUB_BUCKETS;
+
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+
+    static int bucketOf(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return (int)ns;
         }
-        else if (winner == 1)
-        {
-            result += game->player1_name + " WINS this round!\n";
+        int exponent = 63 - __builtin_clzll(ns);
+        int sub = (int)(ns >> (exponent - 3)) & (SUB_BUCKETS - 1);
+        return (exponent - 2) * SUB_BUCKETS + sub;
+    }
+
+    // Smallest value that lands in a bucket
+    static uint64_t bucketStart(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
         }
-        else
-        {
-            result += game->player2_name + " WINS this round!\n";
+        int exponent = bucket / SUB_BUCKETS + 2;
+        return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 3);
+    }
+
+    // Single writer, so plain load + store instead of locked increments
+    void record(uint64_t ns) {
+        std::atomic<uint64_t>& count = counts[bucketOf(ns)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total_ns.store(total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        if (ns > max_ns.load(std::memory_order_relaxed)) {
+            max_ns.store(ns, std::memory_order_relaxed);
         }
+    }
+};
 
-        result += "\nScore: " + game->player1_name + " " + std::to_string(game->score1);
-        result += " - " + std::to_string(game->score2) + " " + game->player2_name + "\n";
+struct ShardProfile {
+    LatencyHistogram points[PROFILE_POINTS];
+};
+thread_local ShardProfile* shard_profile = nullptr;
+std::vector<ShardProfile*> shard_profiles;   // every shard's, for the dump
+std::mutex shard_profiles_lock;
+std::atomic<bool> profile_dump_requested(false);   // set by SIGUSR1
 
-        // Checks if the game is over
-        if (game->isGameOver()) {
-            game->state = GameState::GAME_OVER;
-            result += "\n--- GAME OVER --- \n";
+// Times the enclosing scope into one of this shard's histograms
+struct ProfileTimer {
+    ProfilePoint point;
+    std::chrono::steady_clock::time_point start;
 
-            if (game->score1 > game->score2) {
-                result += game->player1_name + " WINS THE MATCH!\n";
-            } else {
-                result += game->player2_name + " WINS THE MATCH!\n";
-            }
+    explicit ProfileTimer(ProfilePoint p) : point(p), start(std::chrono::steady_clock::now()) {}
+    ~ProfileTimer() {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        shard_profile->points[point].record((uint64_t)ns);
+    }
+};
 
-            result += "\nType 'join' to play again or 'quit' to leave\n";
+#define PROFILE_SCOPE(point) ProfileTimer profile_timer_##point(point)
 
-            // Send to both
-            broadcast(result, game->player1_socket, game->player2_socket);
+void initShardProfile() {
+    shard_profile = new ShardProfile();
+    std::lock_guard<std::mutex> lock(shard_profiles_lock);
+    shard_profiles.push_back(shard_profile);
+}
 
-            // Resets players to CONNECTED state
-            Player *p1 = players[game->player1_socket];
-            Player *p2 = players[game->player2_socket];
-            p1->state = PlayerState::CONNECTED;
-            p2->state = PlayerState::CONNECTED;
+void onProfileSignal(int) {
+    profile_dump_requested.store(true);
+}
 
-            // Cleans up the game
-            active_game.erase(game->player1_socket);
-            active_game.erase(game->player2_socket);
-            delete game;
-        } else {
-            // Proceeds to Next Round
-            result += "\nType 'ready' for next round!\n";
-            broadcast(result, game->player1_socket, game->player2_socket);
+// One point merged over all shards. Reads the live counters, so a
+// snapshot taken mid-update may be off by the samples being recorded
+struct ProfileSummary {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(LatencyHistogram::BUCKETS, 0);
+    uint64_t samples = 0, total_ns = 0, max_ns = 0;
 
-            // Updates states to viewing results
-            Player *p1 = players[game->player1_socket];
-            Player *p2 = players[game->player2_socket];
-            p1->state = PlayerState::VIEWING_RESULTS;
-            p2->state = PlayerState::VIEWING_RESULTS;
+    // Percentile = start of the bucket the ranked sample falls in
+    uint64_t percentile(double q) const {
+        uint64_t rank = (uint64_t)(q * (samples - 1)), seen = 0;
+        for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+            seen += counts[b];
+            if (seen > rank) {
+                return LatencyHistogram::bucketStart(b);
+            }
+        }
+        return max_ns;
+    }
+};
+
+// Caller holds shard_profiles_lock
+ProfileSummary summarizeProfile(int point) {
+    ProfileSummary summary;
+    for (ShardProfile* profile : shard_profiles) {
+        LatencyHistogram& hist = profile->points[point];
+        for (int b = 0; b < LatencyHistogram::BUCKETS; b++) {
+            uint64_t n = hist.counts[b].load(std::memory_order_relaxed);
+            summary.counts[b] += n;
+            summary.samples += n;
         }
+        summary.total_ns += hist.total_ns.load(std::memory_order_relaxed);
+        summary.max_ns = std::max(summary.max_ns, hist.max_ns.load(std::memory_order_relaxed));
     }
+    return summary;
 }
 
-// Handles 'ready' -> starts next round when both players ready
-void handleReadyCommand(int socket, Player* player) {
-    Game *game = active_game[socket];
+// Prints every point merged over all shards
+void dumpProfiles() {
+    std::lock_guard<std::mutex> lock(shard_profiles_lock);
+    std::cout << "--- Latency profile (" << shard_profiles.size() << " shard(s), ns) ---" << std::endl;
+    for (int point = 0; point < PROFILE_POINTS; point++) {
+        ProfileSummary summary = summarizeProfile(point);
+        if (summary.samples == 0) {
+            std::cout << profile_point_names[point] << ": no samples" << std::endl;
+            continue;
+        }
+        std::cout << profile_point_names[point] << ": " << summary.samples << " samples, mean "
+                  << summary.total_ns / summary.samples << ", p50 " << summary.percentile(0.50)
+                  << ", p99 " << summary.percentile(0.99) << ", p999 " << summary.percentile(0.999)
+                  << ", max " << summary.max_ns << std::endl;
+    }
+}
+#else
+#define PROFILE_SCOPE(point)
+#endif
 
-    // Marks the player as ready
-    player->state = PlayerState::IN_GAME_CHOOSING;
+// ------------------- Match History -------------------
+// --history FILE appends every round and match result as fixed-size
+// records (match_history.h). Shards collect records in a thread-local
+// batch and hand it over once per loop iteration; a writer thread writes
+// everything gathered and fsyncs once per --history-sync-ms (group
+// commit), so no handler ever waits on the disk
 
-    Player *p1 = players[game->player1_socket];
-    Player *p2 = players[game->player2_socket];
+int history_fd = -1;                    // -1 = history off
+int history_names_fd = -1;
+int history_sync_ms = 100;
+std::atomic<uint64_t> next_match_id(1);  // see openHistory()
 
-    // if both players are ready, starts new round
-    if (p1->state == PlayerState::IN_GAME_CHOOSING &&
-        p2->state == PlayerState::IN_GAME_CHOOSING) {
-        game->resetRound();
+std::unordered_map<std::string, uint32_t> history_name_ids;  // interned names
+std::string history_pending_names;                           // name table entries not written yet
+std::vector<HistoryRecord> history_pending;                  // records handed over by the shards
+std::mutex history_lock;                                     // guards the three above
+std::atomic<uint64_t> history_record_count(0);               // in the file plus handed over
 
-        std::string msg = "\n--- NEW ROUND---\n";
-        msg += "Type: rock, paper, or scissors\n";
-        broadcast(msg, game->player1_socket, game->player2_socket);
-    } else {
-        // This player is ready, waiting on their opponent
-        std::string msg_waiting = "Ready! Waiting for opponent...\n";
-        send(socket, msg_waiting.c_str(), msg_waiting.length(), 0);
+thread_local std::vector<HistoryRecord> history_batch;       // this shard's records in the current loop iteration
+
+// Opens (or creates) a history or stats file with O_APPEND, checks its header and
+// returns the size of its data (what follows the header), -1 on failure. kind
+// names the file in the error for a wrong header
+off_t openRecordFile(const std::string& path, const char* kind, const char* magic, uint32_t record_size, int& fd) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        std::cerr << "Can't open " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    if (info.st_size == 0) {
+        HistoryHeader header = makeHistoryHeader(magic, record_size);
+        if (!writeAll(fd, (const char*)&header, sizeof(header))) {
+            std::cerr << "Can't write " << path << ": " << strerror(errno) << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+    HistoryHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        !checkHistoryHeader(header, magic, record_size)) {
+        std::cerr << path << " is not a " << kind << " file of this version" << std::endl;
+        return -1;
     }
+    return info.st_size - sizeof(header);
 }
 
-// ------------------- Main -------------------
+// Replaces path with data: written to path.tmp, synced, then renamed over
+// path, so a crash leaves either the old or the new file. Returns the new
+// file's fd (O_APPEND), -1 on failure
+int replaceFile(const std::string& path, const std::string& data) {
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!writeAll(fd, data.data(), data.size()) || fdatasync(fd) < 0 || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp_path.c_str());
+        errno = saved;
+        return -1;
+    }
 
-int main() {
-// ----- Socket Setup -----
-    // Create TCP socket
-    // uses AF_INET/IPv4 and SOCK_STREAM/TCP (stream oriented connection) for reliability
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0); 
-    if (server_fd == -1) { // if returned -1 the stops and fails creation
-        std::cerr << "Socket creation failed!" << std::endl;
-        return 1;
+    // Makes the rename itself durable
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
     }
+    return fd;
+}
 
-    // Allows for resuse of address/port (saves time for quick restarts)
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        std::cerr << "setsockopt failed!" << std::endl;
-        return 1;
+// Opens the history and its name table, loading the names already interned
+// so ids stay the same across restarts. A torn entry at the end of either
+// file (crash mid-write) is cut off
+bool openHistory(const std::string& path) {
+    std::string names_path = path + ".names";
+    off_t names_size = openRecordFile(names_path, "match history name table", HISTORY_NAMES_MAGIC, 0, history_names_fd);
+    if (names_size < 0) {
+        return false;
     }
-    
-    // Configure server address
-    sockaddr_in address;
-    address.sin_family = AF_INET;         // IPv4
-    address.sin_addr.s_addr = INADDR_ANY; // Accept connections on any local network
-    address.sin_port = htons(8080);       // hosts on port 8080 using htons (Host To Network Short)
-    
-    // Bind socket to port 
-    if (::bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0) {
-        std::cerr << "Bind failed!" << std::endl;
-        return 1;
+    std::string names(names_size, '\0');
+    if (pread(history_names_fd, &names[0], names_size, sizeof(HistoryHeader)) != names_size) {
+        std::cerr << "Can't read " << names_path << std::endl;
+        return false;
     }
-    
-    // Listen for connections that are incoming
-    // Second parameter catches if max queued connections
-    if (listen(server_fd, 3) < 0) {
-        std::cerr << "Listen failed!" << std::endl;
-        return 1;
+    size_t pos = 0;
+    while (pos + 2 <= names.size()) {
+        uint16_t len;
+        memcpy(&len, names.data() + pos, 2);
+        if (pos + 2 + len > names.size()) {
+            break;
+        }
+        history_name_ids.emplace(names.substr(pos + 2, len), (uint32_t)history_name_ids.size());
+        pos += 2 + len;
+    }
+    if (pos < names.size() && ftruncate(history_names_fd, sizeof(HistoryHeader) + pos) < 0) {
+        return false;
     }
-    
-    std::cout << "Server listening on port 8080..." << std::endl;
-    
 
-    // ----- SELECT() LOOP -----
+    off_t records_size = openRecordFile(path, "match history", HISTORY_MAGIC, sizeof(HistoryRecord), history_fd);
+    if (records_size < 0) {
+        return false;
+    }
+    off_t whole = records_size - records_size % sizeof(HistoryRecord);
+    if (whole < records_size && ftruncate(history_fd, sizeof(HistoryHeader) + whole) < 0) {
+        return false;
+    }
 
-    // select() requires fd_set to track which sockets to monitor
-    fd_set read_fds; // set the file descriptors to monitor to read the activity
+    // Match ids are (run << 32) + counter. Matches still running when the
+    // last run stopped may have ids past the last record's, so this run
+    // takes the next run number rather than the next id
+    HistoryRecord last;
+    if (whole > 0 && pread(history_fd, &last, sizeof(last), sizeof(HistoryHeader) + whole - sizeof(last)) == sizeof(last)) {
+        next_match_id = ((last.match_id >> 32) + 1) << 32;
+    }
+    history_record_count = whole / sizeof(HistoryRecord);
+    LOG(INFO) << "Match history: " << path << ", " << whole / sizeof(HistoryRecord) << " record(s), "
+              << history_name_ids.size() << " name(s)";
+    return true;
+}
 
-    // Main Server loop
-    while (true) { // Accepts and handles clients through select
-        
-        // ---- Prepare FD_SET ----
+// Id of a player name in the history, new names are queued for the name table
+uint32_t internName(const std::string& name) {
+    std::lock_guard<std::mutex> lock(history_lock);
+    auto it = history_name_ids.find(name);
+    if (it != history_name_ids.end()) {
+        return it->second;
+    }
+    uint32_t id = (uint32_t)history_name_ids.size();
+    history_name_ids.emplace(name, id);
+
+    uint16_t len = (uint16_t)std::min<size_t>(name.size(), UINT16_MAX);
+    history_pending_names.append((const char*)&len, 2);
+    history_pending_names.append(name, 0, len);
+    return id;
+}
+
+// Adds a record of the game's current round or outcome to this shard's batch
+void recordHistory(const Game* game, HistoryType type, uint8_t flags = 0) {
+    if (history_fd < 0) {
+        return;
+    }
+    HistoryRecord record;
+    record.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.match_id = game->match_id;
+    record.player1 = game->player1->name_id;
+    record.player2 = game->player2->name_id;
+    record.type = type;
+    record.choice1 = type == HIST_ROUND ? (uint8_t)game->choice1 : 0;
+    record.choice2 = type == HIST_ROUND ? (uint8_t)game->choice2 : 0;
+    record.score1 = (uint8_t)game->score1;
+    record.score2 = (uint8_t)game->score2;
+    record.flags = flags;
+    record.round = (uint16_t)game->round;
+    history_batch.push_back(record);
+}
+
+// Hands this loop iteration's records to the writer (one lock per iteration)
+void submitHistory() {
+    if (history_batch.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(history_lock);
+    history_pending.insert(history_pending.end(), history_batch.begin(), history_batch.end());
+    history_record_count += history_batch.size();
+    history_batch.clear();
+}
+
+// Writes and syncs everything handed over so far, one write() and
+// fdatasync() per file. Names go first, so every id in a record on disk
+// can be resolved
+std::mutex history_write_lock;    // one drain at a time (writer thread, live upgrade)
+void drainHistory() {
+    std::lock_guard<std::mutex> write_lock(history_write_lock);
+    std::string names;
+    std::vector<HistoryRecord> records;
+    {
+        std::lock_guard<std::mutex> lock(history_lock);
+        names.swap(history_pending_names);
+        records.swap(history_pending);
+    }
+    if (!names.empty()) {
+        if (!writeAll(history_names_fd, names.data(), names.size()) || fdatasync(history_names_fd) < 0) {
+            LOG(ERROR) << "Match history name table write failed: " << (const char*)strerror(errno);
+        }
+    }
+    if (!records.empty()) {
+        if (!writeAll(history_fd, (const char*)records.data(), records.size() * sizeof(HistoryRecord)) ||
+            fdatasync(history_fd) < 0) {
+            LOG(ERROR) << "Match history write failed: " << (const char*)strerror(errno);
+        }
+    }
+}
+
+// Background writer, drains once per interval (group commit)
+void historyWriterLoop() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(history_sync_ms));
+        drainHistory();
+    }
+}
+
+// ------------------- Player Stats Store -------------------
+// --stats FILE keeps player_stats across restarts. The file is a log:
+// every match end appends the new stats of both players as
+// [u16 name length][name][PlayerStats], the last entry of a name wins.
+// It is read once at startup, after that logins only look in the map.
+// A writer thread appends the queued entries once a second, and once the
+// log holds more than twice as many entries as there are names it is
+// rewritten with one entry per name (compaction). The writer keeps its own
+// copy of the latest stats for that, so compaction never holds stats_lock
+
+const char STATS_MAGIC[8] = {'R', 'P', 'S', 'S', 'T', 'A', 'T', '1'};
+const int STATS_SYNC_MS = 1000;
+const size_t STATS_COMPACT_MIN = 4096;  // log entries before compaction is considered
+
+bool stats_enabled = false;
+std::string stats_path;
+int stats_fd = -1;                      // these three under stats_write_lock once running
+size_t stats_log_entries = 0;           // entries in the file
+std::unordered_map<std::string, PlayerStats> stats_latest;  // what the file holds, for compaction
+std::mutex stats_write_lock;            // one drain at a time (writer thread, live upgrade)
+std::vector<std::pair<std::string, PlayerStats>> stats_pending;  // not written yet, guarded by stats_lock
+
+void appendStatsEntry(std::string& out, const std::string& name, const PlayerStats& stats) {
+    uint16_t len = (uint16_t)std::min<size_t>(name.size(), UINT16_MAX);
+    out.append((const char*)&len, 2);
+    out.append(name, 0, len);
+    out.append((const char*)&stats, sizeof(stats));
+}
+
+// Loads the stats log into player_stats (same header as the history files),
+// cutting off a torn entry at the end
+bool openStats(const std::string& path) {
+    off_t size = openRecordFile(path, "player stats", STATS_MAGIC, sizeof(PlayerStats), stats_fd);
+    if (size < 0) {
+        return false;
+    }
+    std::string data(size, '\0');
+    if (pread(stats_fd, &data[0], size, sizeof(HistoryHeader)) != size) {
+        std::cerr << "Can't read " << path << std::endl;
+        return false;
+    }
+    size_t pos = 0;
+    while (pos + 2 <= data.size()) {
+        uint16_t len;
+        memcpy(&len, data.data() + pos, 2);
+        if (pos + 2 + len + sizeof(PlayerStats) > data.size()) {
+            break;
+        }
+        PlayerStats stats;
+        memcpy(&stats, data.data() + pos + 2 + len, sizeof(stats));
+        player_stats[data.substr(pos + 2, len)] = stats;
+        stats_log_entries++;
+        pos += 2 + len + sizeof(PlayerStats);
+    }
+    if (pos < data.size() && ftruncate(stats_fd, sizeof(HistoryHeader) + pos) < 0) {
+        return false;
+    }
+    stats_latest = player_stats;
+    stats_path = path;
+    stats_enabled = true;
+    LOG(INFO) << "Player stats: " << path << ", " << player_stats.size() << " player(s) from "
+              << stats_log_entries << " entries";
+    return true;
+}
+
+// Rewrites the log with one entry per name (see replaceFile)
+void compactStats(const std::unordered_map<std::string, PlayerStats>& latest) {
+    HistoryHeader header = makeHistoryHeader(STATS_MAGIC, sizeof(PlayerStats));
+    std::string out((const char*)&header, sizeof(header));
+    for (const auto& entry : latest) {
+        appendStatsEntry(out, entry.first, entry.second);
+    }
+    int fd = replaceFile(stats_path, out);
+    if (fd < 0) {
+        LOG(ERROR) << "Player stats compaction failed: " << (const char*)strerror(errno);
+        return;
+    }
+
+    LOG(INFO) << "Player stats compacted from " << stats_log_entries << " to " << latest.size() << " entries";
+    close(stats_fd);
+    stats_fd = fd;
+    stats_log_entries = latest.size();
+}
+
+// Appends and syncs the entries queued so far, compacting when due
+void drainStats() {
+    std::lock_guard<std::mutex> write_lock(stats_write_lock);
+    std::vector<std::pair<std::string, PlayerStats>> entries;
+    {
+        std::lock_guard<std::mutex> lock(stats_lock);
+        entries.swap(stats_pending);
+    }
+    if (entries.empty()) {
+        return;
+    }
+    std::string out;
+    for (const auto& entry : entries) {
+        stats_latest[entry.first] = entry.second;
+        appendStatsEntry(out, entry.first, entry.second);
+    }
+    if (!writeAll(stats_fd, out.data(), out.size()) || fdatasync(stats_fd) < 0) {
+        LOG(ERROR) << "Player stats write failed: " << (const char*)strerror(errno);
+    }
+    stats_log_entries += entries.size();
+
+    if (stats_log_entries > STATS_COMPACT_MIN && stats_log_entries > 2 * stats_latest.size()) {
+        compactStats(stats_latest);
+    }
+}
+
+// Background writer for the stats log
+void statsWriterLoop() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(STATS_SYNC_MS));
+        drainStats();
+    }
+}
+
+// ------------------- Global State ------------------- 
+// Each shard thread has its own copy, so games never need locks
+
+// Session -> connection slot. Session ids are small dense integers, so a
+// flat table indexed by them finds a player in O(1). The generation changes
+// every time a slot is released, so a saved ConnectionRef never matches a
+// later session that reused the same id
+struct ConnectionSlot {
+    Player* player = nullptr;
+    uint32_t generation = 0;
+    int handle = -1;          // the transport's own id for the session (socket fd), -1 if free
+};
+struct ConnectionRef {
+    SessionId session;
+    uint32_t generation;
+};
+
+thread_local MatchmakingQueue matchmaking_queue;  // players waiting for a match
+
+// Joins only flag the queue, pairing runs once per loop iteration (or at
+// most every match_interval_ms) over everyone who joined in the meantime
+int match_interval_ms = 0;                        // 0 = every loop iteration
+thread_local bool matchmaking_pending = false;    // players joined since the last pass
+thread_local std::chrono::steady_clock::time_point last_match_pass;
+
+// Player timeouts in seconds, 0 = never (--choice-timeout etc.)
+int choice_timeout_s = 30;    // to pick rock/paper/scissors
+int ready_timeout_s = 60;     // to type 'ready' after a round
+int queue_timeout_s = 300;    // to be matched after 'join'
+int idle_timeout_s = 600;     // to send anything while not queued or playing
+
+// How long an unterminated first line waits for its '\n' before the client
+// is taken for one from before line framing (see startUnframed)
+const int UNFRAMED_GRACE_MS = 500;
+const int TIMER_TICK_MS = 100;
+thread_local TimingWheel timing_wheel;
+thread_local std::chrono::steady_clock::time_point wheel_started;   // tick 0
+
+// Clock of the game logic (queue waits, matchmaking, timers), read once
+// per loop iteration so every handler and stage of an iteration sees the
+// same time. While replaying (--replay) it is the journal's time
+thread_local std::chrono::steady_clock::time_point loop_now;
+
+thread_local std::vector<ConnectionSlot> connections; // session -> player object
+thread_local std::vector<SessionId> free_sessions;     // released slots, reused first
+thread_local ObjectPool<Player> player_pool("Player");
+thread_local ObjectPool<Game> game_pool("Game");
+thread_local std::vector<ConnectionRef> pending_disconnects; // players to drop once the current handlers are done
+thread_local std::vector<ConnectionRef> dirty_outputs;       // players with output queued during this loop iteration
+thread_local std::string reply_buffer;                       // round results (and other replies built from names) are formatted here
+
+// Queued output above this disconnects the client (--max-output-bytes),
+// so one slow reader can't grow memory without bound
+size_t output_high_water = 64 * 1024;
+
+// Outbound half of a transport, all the game logic ever asks of one:
+// replies are queued in Player::output and handed over here once per loop
+// iteration, and sessions are ended here. Nothing above the transport
+// touches a socket, so the handlers run the same over any of them
+struct SessionSink {
+    virtual ~SessionSink() {}
+    virtual void flush(Player* player) = 0;                             // write queued output (once per loop iteration)
+    virtual void closeSession(SessionId session) = 0;                   // last try at queued output, then release the connection
+};
+
+// Event backend interface: a transport plus the loop that waits on it. It
+// owns its connections' I/O, opens a session for each one
+// (onClientConnected, with the transport's own handle for it) and drives
+// the handlers below through handleClientMessage / onClientClosed /
+// onSendFailed. Handles are opaque to everything but the transport itself
+// (the socket fd for epoll and io_uring).
+// Chosen once at startup (epoll by default, io_uring with --io-uring)
+struct EventBackend : SessionSink {
+    virtual const char* name() = 0;
+    virtual bool init(int server_fd) = 0;                               // false = backend unavailable
+    virtual bool pauseReading(SessionId session) = 0;                   // no more reads for it, true once none of its I/O is in flight
+    virtual void resumeReading(SessionId session) = 0;                  // undoes pauseReading
+    virtual int detachSession(SessionId session) = 0;                   // stop serving it (paused first), returns its handle (moves elsewhere)
+    virtual void adoptClient(SessionId session) = 0;                    // start serving a session opened for a handed-over handle
+    virtual void watchWakeup(int event_fd) = 0;                         // calls onShardWakeup() when signaled
+    virtual void runOnce(int timeout_ms) = 0;                           // wait (-1 = forever) for and dispatch one batch of events
+    virtual void stopReading() = 0;                                     // no more accepts/reads (live upgrade)
+    virtual bool busy() = 0;                                            // reads or sends still in flight in the kernel
+};
+thread_local EventBackend* backend = nullptr;
+
+// Per-shard counters served by the admin endpoint (--admin-port). Each is
+// written only by its own shard (plain load + store, no locked instruction)
+// and only summed up when scraped
+struct ShardMetrics {
+    std::atomic<int64_t> players[5] = {};         // by PlayerState
+    std::atomic<int64_t> games[4] = {};           // by GameState
+    std::atomic<int64_t> output_bytes{0};         // queued, not yet handed to the kernel
+    std::atomic<int64_t> connects{0};
+    std::atomic<int64_t> disconnects{0};
+    std::atomic<int64_t> rounds{0};
+    std::atomic<int64_t> matches{0};              // started
+    std::atomic<int64_t> match_wait_ms_sum{0};    // longer wait of the two, over the matches started
+    std::atomic<int64_t> match_wait_ms_max{0};
+    std::atomic<int64_t> match_rating_gap_sum{0};
+    std::atomic<int64_t> match_rating_gap_max{0};
+    std::atomic<int64_t> forfeits_disconnect{0};
+    std::atomic<int64_t> forfeits_timeout{0};
+    std::atomic<int64_t> timeouts[5] = {};        // by TimerKind
+};
+
+void addMetric(std::atomic<int64_t>& metric, int64_t delta = 1) {
+    metric.store(metric.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void maxMetric(std::atomic<int64_t>& metric, int64_t value) {
+    if (value > metric.load(std::memory_order_relaxed)) {
+        metric.store(value, std::memory_order_relaxed);
+    }
+}
+
+// A player on its way to another shard. Session ids are per shard, so it
+// travels with its transport handle and the receiver opens a new session
+// for that (all shards run the same kind of backend)
+struct HandedPlayer {
+    Player player;
+    int handle;
+};
+
+// One shard per thread (--threads N): own listen socket (SO_REUSEPORT),
+// backend, players and games. The inbox is the only cross-thread state,
+// used to hand a lone queued player to a shard that has another one
+struct Shard {
+    int id;
+    int wakeup_fd;                  // eventfd, signaled when the inbox fills
+    int listen_fd;
+    ShardMetrics metrics;
+    std::atomic<bool> snapshot_clean{true};  // every change handed to the snapshot writer (see snapshotStep)
+    std::mutex inbox_lock;
+    std::vector<HandedPlayer> inbox;    // players handed over by other shards (moved out of
+                                        // the sender's pool, the receiver re-pools them)
+};
+std::vector<Shard*> shards;
+thread_local Shard* current_shard = nullptr;
+thread_local ShardMetrics* shard_metrics = nullptr;   // current_shard->metrics
+
+// Shard currently advertising a lone queued player, -1 if none
+std::atomic<int> lobby_shard(-1);
+std::mutex lobby_lock;
+
+// Set when a new process takes over (--upgrade-socket, see Live Upgrade)
+std::atomic<bool> upgrade_requested(false);
+
+
+// ------------------- Input Journal -------------------
+// --journal FILE records everything that reaches the handlers from the
+// network: accepted connections, every chunk read (with its session and
+// time), and the disconnects the backend noticed (peer closed, send
+// failed). At the end of each loop iteration a marker notes when it ran
+// (the loop_now every handler and stage in it saw). --replay FILE
+// feeds the journal back through the same handlers without sockets (see
+// Journal Replay), so production traffic becomes a reproducible CPU
+// benchmark. Entries are batched per loop iteration and written by a
+// background thread, like the match history
+//
+// File: HistoryHeader (JOURNAL_MAGIC), JournalSettings, the settings'
+// player_count stats entries (as in the --stats log), then JournalEntry
+// records, a DATA entry followed by its bytes. The settings and stats are
+// what the game started from, so a replay pairs players by the same
+// ratings and times out at the same moments without any other options.
+// Nothing else is: recording refuses --snapshot and --upgrade-socket,
+// whose recovered matches and sessions would be missing from it.
+// Times are nanoseconds since the shard's wheel_started, so timers fire
+// at the same ticks on replay
+
+const char JOURNAL_MAGIC[8] = {'R', 'P', 'S', 'J', 'R', 'N', 'L', '2'};
+
+// Game options in effect while recording
+struct JournalSettings {
+    int32_t choice_timeout_s;
+    int32_t ready_timeout_s;
+    int32_t queue_timeout_s;
+    int32_t idle_timeout_s;
+    int32_t match_interval_ms;
+    uint32_t player_count;      // stats entries that follow
+    uint64_t max_output_bytes;
+};
+static_assert(sizeof(JournalSettings) == 32, "JournalSettings is a fixed on-disk size");
+
+enum JournalType : uint8_t {
+    JOURNAL_CONNECT = 1,        // onClientConnected
+    JOURNAL_DATA = 2,           // handleClientMessage, length bytes follow
+    JOURNAL_CLOSED = 3,         // peer closed or read error, handleDisconnect
+    JOURNAL_DROPPED = 4,        // send failed, disconnectLater
+    JOURNAL_ITERATION = 5,      // end of a loop iteration (session unused)
+};
+
+struct JournalEntry {
+    uint64_t time_ns;           // loop_now, exact so every comparison with it comes out the same
+    int32_t session;
+    uint32_t length;
+    uint8_t type;
+    uint8_t padding[7];
+};
+static_assert(sizeof(JournalEntry) == 24, "JournalEntry is a fixed on-disk size");
+
+int journal_fd = -1;                        // -1 = journal off
+std::string journal_pending;                // handed over, not written yet
+std::mutex journal_lock;                    // guards journal_pending
+thread_local std::string journal_batch;     // this loop iteration's entries
+
+void journalEvent(JournalType type, SessionId session, const char* data = nullptr, uint32_t length = 0) {
+    if (journal_fd < 0) {
+        return;
+    }
+    JournalEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(loop_now - wheel_started).count();
+    entry.session = session;
+    entry.length = length;
+    entry.type = type;
+    journal_batch.append((const char*)&entry, sizeof(entry));
+    journal_batch.append(data, length);
+}
+
+// End of a loop iteration: the marker and the hand-over to the writer.
+// Every iteration gets one, even an idle one, since the timers and
+// matchmaking passes it ran depend on its time
+void submitJournal() {
+    if (journal_fd < 0) {
+        return;
+    }
+    journalEvent(JOURNAL_ITERATION, 0);
+
+    std::lock_guard<std::mutex> lock(journal_lock);
+    journal_pending += journal_batch;
+    journal_batch.clear();
+}
+
+// Creates the journal with the settings and the stats loaded so far
+// (before any shard runs)
+bool openJournal(const std::string& path) {
+    journal_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    HistoryHeader header = makeHistoryHeader(JOURNAL_MAGIC, sizeof(JournalEntry));
+    JournalSettings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.choice_timeout_s = choice_timeout_s;
+    settings.ready_timeout_s = ready_timeout_s;
+    settings.queue_timeout_s = queue_timeout_s;
+    settings.idle_timeout_s = idle_timeout_s;
+    settings.match_interval_ms = match_interval_ms;
+    settings.player_count = player_stats.size();
+    settings.max_output_bytes = output_high_water;
+    std::string out((const char*)&header, sizeof(header));
+    out.append((const char*)&settings, sizeof(settings));
+    for (const auto& entry : player_stats) {
+        appendStatsEntry(out, entry.first, entry.second);
+    }
+    if (journal_fd < 0 || !writeAll(journal_fd, out.data(), out.size())) {
+        std::cerr << "Can't write " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Background writer, no fsync: a journal is for benchmarks, not recovery
+void journalWriterLoop() {
+    std::string out;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        {
+            std::lock_guard<std::mutex> lock(journal_lock);
+            out.swap(journal_pending);
+        }
+        if (!out.empty() && !writeAll(journal_fd, out.data(), out.size())) {
+            LOG(ERROR) << "Journal write failed: " << (const char*)strerror(errno);
+        }
+        out.clear();
+    }
+}
+
+// ------------------- Replies -------------------
+// Fixed reply text lives here as constants; handlers append it (and the
+// player names it wraps) straight into the player's output queue, which
+// keeps its capacity between writes, so steady-state rounds don't allocate
+
+constexpr std::string_view REPLY_MENU =
+    "\n--- Rock Paper Scissors ---\n"
+    "Commands:\n"
+    "join - Join matchmaking queue\n"
+    "rock/paper/scissors - make your chioce\n"
+    "quit - Exits the game\n";
+constexpr std::string_view REPLY_JOINED = "Joined matchmaking queue. Waiting for opponent...\n";
+constexpr std::string_view REPLY_MATCH_FOUND = "\n--- MATCH FOUND ---\nPlaying against: ";
+constexpr std::string_view REPLY_CHOOSE = "\nChoose: rock, paper, or scissors\n";   // follows the opponent name
+constexpr std::string_view REPLY_MATCH_RESUMED = "\n--- MATCH RESUMED ---\nPlaying against: ";
+constexpr std::string_view REPLY_INTERRUPTED_START = "\n--- MATCH INTERRUPTED ---\nYour match against ";
+constexpr std::string_view REPLY_INTERRUPTED_END = " was cut off by a server restart.\nWaiting for them to come back, it carries on from the same score...\n";
+constexpr std::string_view REPLY_CHOICE_LOCKED = "Choice locked in! Waiting for opponent...\n";
+constexpr std::string_view REPLY_ROUND_RESULT = "\n--- ROUND RESULT ---\n";
+constexpr std::string_view REPLY_CHOSE = " chose: ";              // follows a player name
+constexpr std::string_view REPLY_TIE = "It's a TIE!\n";
+constexpr std::string_view REPLY_WINS_ROUND = " WINS this round!\n";  // follows a player name
+constexpr std::string_view REPLY_WINS_MATCH = " WINS THE MATCH!\n";   // follows a player name
+constexpr std::string_view REPLY_SCORE = "\nScore: ";
+constexpr std::string_view REPLY_GAME_OVER = "\n--- GAME OVER --- \n";
+constexpr std::string_view REPLY_PLAY_AGAIN = "\nType 'join' to play again or 'quit' to leave\n";
+constexpr std::string_view REPLY_NEXT_ROUND = "\nType 'ready' for next round!\n";
+constexpr std::string_view REPLY_NEW_ROUND = "\n--- NEW ROUND---\nType: rock, paper, or scissors\n";
+constexpr std::string_view REPLY_READY_WAITING = "Ready! Waiting for opponent...\n";
+constexpr std::string_view REPLY_FORFEIT_START = "\n--- OPPONENT DISCONNECTED ---\nYour opponent, ";
+constexpr std::string_view REPLY_FORFEIT_END = ", has left the game. You win by forfeit\nType 'join' to find a new match\n";
+constexpr std::string_view REPLY_TIMED_OUT = "\n--- TIME'S UP ---\nYou didn't respond in time and forfeit the match\nType 'join' to play again or 'quit' to leave\n";
+constexpr std::string_view REPLY_OPPONENT_TIMED_OUT_START = "\n--- OPPONENT TIMED OUT ---\nYour opponent, ";
+constexpr std::string_view REPLY_OPPONENT_TIMED_OUT_END = ", didn't respond in time. You win by forfeit\nType 'join' to find a new match\n";
+constexpr std::string_view REPLY_QUEUE_TIMED_OUT = "No match found in time, you left the queue.\nType 'join' to try again\n";
+constexpr std::string_view REPLY_IDLE_TIMED_OUT = "Disconnected for inactivity.\n";
+constexpr std::string_view REPLY_GOODBYE = "Goodbye!\n";
+constexpr std::string_view REPLY_UNKNOWN_COMMAND = "Unknown command. ";
+constexpr std::string_view REPLY_TOO_LONG = "Command too long.\n";
+
+// Sent when a command doesn't fit the player's state, indexed by PlayerState
+constexpr std::string_view REPLY_WRONG_STATE[] = {
+    "You're not in a game! Type 'join' to play.\n",          // CONNECTED
+    "You're in queue. Please wait for a match.\n",           // IN_QUEUE
+    "Invalid command! Type: rock, paper, or scissors\n",     // IN_GAME_CHOOSING
+    "Waiting for opponent to choose...\n",                   // IN_GAME_WAITING
+    "Type 'ready' for next round!\n",                        // VIEWING_RESULTS
+};
+
+// Follows "Unknown command. ", indexed by PlayerState
+constexpr std::string_view REPLY_UNKNOWN_HINT[] = {
+    "Type 'join' to play!\n",
+    "You're in queue. Please wait for a match.\n",
+    "Invalid choice! Type: rock, paper, or scissors\n",
+    "Waiting for opponent to choose...\n",
+    "Type 'ready' for next round!\n",
+};
+
+// ------------------- Helper Functions ------------------- 
+
+// Looks up the player of a session, nullptr if none
+Player* findPlayer(SessionId session) {
+    if (session < 0 || session >= (int)connections.size()) {
+        return nullptr;
+    }
+    return connections[session].player;
+}
+
+// Looks up a saved reference, nullptr if that connection is gone
+Player* findPlayer(ConnectionRef ref) {
+    Player* player = findPlayer(ref.session);
+    if (player == nullptr || connections[ref.session].generation != ref.generation) {
+        return nullptr;
+    }
+    return player;
+}
+
+ConnectionRef refOf(Player* player) {
+    return ConnectionRef{player->session, player->generation};
+}
+
+// Starts a session for a connection the transport took on, handle is the
+// transport's own id for it (-1 if it needs none)
+SessionId openSession(int handle) {
+    SessionId session;
+    if (free_sessions.empty()) {
+        session = connections.size();
+        connections.emplace_back();
+    } else {
+        session = free_sessions.back();
+        free_sessions.pop_back();
+    }
+    connections[session].handle = handle;
+    return session;
+}
+
+// Transport handle of a session, -1 if none
+int sessionHandle(SessionId session) {
+    if (session < 0 || session >= (int)connections.size()) {
+        return -1;
+    }
+    return connections[session].handle;
+}
+
+// Registers a player in its session's slot
+void addPlayer(Player* player) {
+    ConnectionSlot& slot = connections[player->session];
+    slot.player = player;
+    player->generation = slot.generation;
+}
+
+// Ends a session: its slot is released and outstanding references to it
+// go stale (the transport must be done with the handle)
+void removePlayer(SessionId session) {
+    ConnectionSlot& slot = connections[session];
+    slot.player = nullptr;
+    slot.handle = -1;
+    slot.generation++;
+    free_sessions.push_back(session);
+}
+
+// Moves a player to another state, keeping the per-state counts
+void setState(Player* player, PlayerState state) {
+    addMetric(shard_metrics->players[(int)player->state], -1);
+    addMetric(shard_metrics->players[(int)state]);
+    player->state = state;
+}
+
+// Same for a game
+void setGameState(Game* game, GameState state) {
+    addMetric(shard_metrics->games[(int)game->state], -1);
+    addMetric(shard_metrics->games[(int)state]);
+    game->state = state;
+}
+
+// Schedules a player to be disconnected after the current handlers return
+// (handlers keep using the player/game after a send, so it can't happen inline)
+void disconnectLater(SessionId session) {
+    Player* player = findPlayer(session);
+    if (player == nullptr || player->closing) {
+        return;
+    }
+    player->closing = true;
+    pending_disconnects.push_back(refOf(player));
+}
+
+// Lists a player's output for the end-of-iteration flush
+void queueFlush(Player* player) {
+    if (!player->output_dirty) {
+        player->output_dirty = true;
+        dirty_outputs.push_back(refOf(player));
+    }
+}
+
+// Queues a reply for one player, given as pieces so nothing is concatenated
+// first. Everything a player gets during one loop iteration goes out
+// together in a single write from flushOutputs()
+void sendParts(SessionId session, std::initializer_list<std::string_view> parts) {
+    Player* player = findPlayer(session);
+    if (player == nullptr || player->closing) {
+        return;
+    }
+    for (std::string_view part : parts) {
+        player->output.append(part.data(), part.size());
+        addMetric(shard_metrics->output_bytes, part.size());
+    }
+
+    // Client stopped reading, drops it instead of buffering forever
+    if (player->pendingOutput() > output_high_water) {
+        LOG(WARNING) << (player->name.empty() ? "Unknown" : player->name) << " (session " << session
+                  << ") fell too far behind, disconnecting";
+        disconnectLater(session);
+        return;
+    }
+    queueFlush(player);
+}
+
+// Queues a single-piece reply
+void sendMessage(SessionId session, std::string_view message) {
+    sendParts(session, {message});
+}
+
+// Writes every player's output queued during this loop iteration
+void flushOutputs() {
+    for (ConnectionRef ref : dirty_outputs) {
+        Player* player = findPlayer(ref);
+        if (player == nullptr) {
+            continue; // disconnected meanwhile
+        }
+        player->output_dirty = false;
+        backend->flush(player);
+    }
+    dirty_outputs.clear();
+}
+
+// Convert Choice enum to string for display
+std::string_view choiceToString(Choice c) {
+    if(c == Choice::ROCK) return "rock";
+    if(c == Choice::PAPER) return "paper";
+    if(c == Choice::SCISSORS) return "scissors";
+    return "none";
+}
+
+// Appends an integer without a temporary string
+void appendNumber(std::string& out, int value) {
+    char digits[12];
+    char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    out.append(digits, end - digits);
+}
+
+// Round result text, with the names read from the players at send time
+// (out is a reused buffer, so nothing is allocated per game or round)
+void appendRoundResult(std::string& out, const Game* game, int winner) {
+    const std::string& name1 = game->player1->name;
+    const std::string& name2 = game->player2->name;
+    out += REPLY_ROUND_RESULT;
+    out += name1;
+    out += REPLY_CHOSE;
+    out += choiceToString(game->choice1);
+    out += '\n';
+    out += name2;
+    out += REPLY_CHOSE;
+    out += choiceToString(game->choice2);
+    out += '\n';
+    if (winner == 0) {
+        out += REPLY_TIE;
+    } else {
+        out += winner == 1 ? name1 : name2;
+        out += REPLY_WINS_ROUND;
+    }
+    out += REPLY_SCORE;
+    out += name1;
+    out += ' ';
+    appendNumber(out, game->score1);
+    out += " - ";
+    appendNumber(out, game->score2);
+    out += ' ';
+    out += name2;
+    out += '\n';
+}
+
+// ---- Replies per protocol ----
+// Text players get the REPLY_* text, binary players one frame
+// (binary_protocol.h) with the same information packed
+
+// Enum values go on the wire as-is
+static_assert((int)Choice::ROCK == BIN_ROCK && (int)Choice::PAPER == BIN_PAPER &&
+              (int)Choice::SCISSORS == BIN_SCISSORS, "Choice must match BinaryChoice");
+static_assert((int)PlayerState::CONNECTED == BIN_STATE_CONNECTED &&
+              (int)PlayerState::VIEWING_RESULTS == BIN_STATE_VIEWING_RESULTS, "PlayerState must match BinaryState");
+
+bool isBinary(const Player* player) {
+    return player->protocol == Protocol::BINARY;
+}
+
+// Frame with a payload of up to two pieces
+void sendFrame(Player* player, BinaryOp op, std::string_view part1 = {}, std::string_view part2 = {}) {
+    char header[6];
+    size_t header_len = encodeFrameHeader(op, part1.size() + part2.size(), header);
+    sendParts(player->session, {std::string_view(header, header_len), part1, part2});
+}
+
+// Replies without fields
+void sendReply(Player* player, BinaryOp op, std::string_view text) {
+    if (isBinary(player)) {
+        sendFrame(player, op);
+    } else {
+        sendMessage(player->session, text);
+    }
+}
+
+// Names in frames are cut to BIN_MAX_NAME (text usernames can be longer)
+std::string_view frameName(const std::string& name) {
+    return std::string_view(name).substr(0, BIN_MAX_NAME);
+}
+
+void sendWelcome(Player* player) {
+    if (isBinary(player)) {
+        char rating[5];
+        sendFrame(player, BIN_WELCOME, std::string_view(rating, encodeVarint(std::max(player->stats.rating, 0), rating)));
+    } else {
+        sendMessage(player->session, REPLY_MENU);
+    }
+}
+
+void sendMatchFound(Player* player, Player* opponent) {
+    if (isBinary(player)) {
+        char rating[5];
+        sendFrame(player, BIN_MATCH_FOUND, std::string_view(rating, encodeVarint(std::max(opponent->stats.rating, 0), rating)),
+                  frameName(opponent->name));
+    } else {
+        sendParts(player->session, {REPLY_MATCH_FOUND, opponent->name, REPLY_CHOOSE});
+    }
+}
+
+// Back in a match the last run left unfinished (see resumeMatch)
+void sendMatchResumed(Player* player, Player* opponent, int score, int opponent_score) {
+    if (isBinary(player)) {
+        char scores[2] = {(char)score, (char)opponent_score};
+        sendFrame(player, BIN_MATCH_RESUMED, std::string_view(scores, 2), frameName(opponent->name));
+    } else {
+        std::string& text = reply_buffer;
+        text.clear();
+        text += REPLY_MATCH_RESUMED;
+        text += opponent->name;
+        text += REPLY_SCORE;
+        text += player->name;
+        text += ' ';
+        appendNumber(text, score);
+        text += " - ";
+        appendNumber(text, opponent_score);
+        text += ' ';
+        text += opponent->name;
+        text += REPLY_CHOOSE;
+        sendMessage(player->session, text);
+    }
+}
+
+// Waiting for the opponent of an interrupted match (see rejoinInterruptedMatch)
+void sendMatchInterrupted(Player* player, const std::string& opponent_name) {
+    if (isBinary(player)) {
+        sendFrame(player, BIN_JOINED);
+    } else {
+        sendParts(player->session, {REPLY_INTERRUPTED_START, opponent_name, REPLY_INTERRUPTED_END});
+    }
+}
+
+void sendOpponentLeft(Player* player, const std::string& opponent_name) {
+    if (isBinary(player)) {
+        sendFrame(player, BIN_OPPONENT_LEFT, frameName(opponent_name));
+    } else {
+        sendParts(player->session, {REPLY_FORFEIT_START, opponent_name, REPLY_FORFEIT_END});
+    }
+}
+
+// The player's own timeout ran out (see onTimerExpired)
+void sendTimedOut(Player* player, BinaryTimeout reason, std::string_view text) {
+    if (isBinary(player)) {
+        char payload[1] = {(char)reason};
+        sendFrame(player, BIN_TIMED_OUT, std::string_view(payload, 1));
+    } else {
+        sendMessage(player->session, text);
+    }
+}
+
+void sendOpponentTimedOut(Player* player, const std::string& opponent_name) {
+    if (isBinary(player)) {
+        sendFrame(player, BIN_OPPONENT_TIMED_OUT, frameName(opponent_name));
+    } else {
+        sendParts(player->session, {REPLY_OPPONENT_TIMED_OUT_START, opponent_name, REPLY_OPPONENT_TIMED_OUT_END});
+    }
+}
+
+// Command not allowed in the player's current state
+void sendWrongState(Player* player) {
+    if (isBinary(player)) {
+        char payload[2] = {(char)BIN_ERR_WRONG_STATE, (char)player->state};
+        sendFrame(player, BIN_ERROR, std::string_view(payload, 2));
+    } else {
+        sendMessage(player->session, REPLY_WRONG_STATE[(int)player->state]);
+    }
+}
+
+void sendUnknownCommand(Player* player) {
+    if (isBinary(player)) {
+        char payload[2] = {(char)BIN_ERR_UNKNOWN_COMMAND, (char)player->state};
+        sendFrame(player, BIN_ERROR, std::string_view(payload, 2));
+    } else {
+        sendParts(player->session, {REPLY_UNKNOWN_COMMAND, REPLY_UNKNOWN_HINT[(int)player->state]});
+    }
+}
+
+// Round result to both players (plus the game over text once the game is decided).
+// The text version is formatted once and copied to whichever players use text
+void sendRoundResult(Game* game, int winner) {
+    bool game_over = game->state == GameState::GAME_OVER;
+    Player* players[2] = {game->player1, game->player2};
+
+    if (!isBinary(players[0]) || !isBinary(players[1])) {
+        std::string& result = reply_buffer;
+        result.clear();
+        appendRoundResult(result, game, winner);
+        if (game_over) {
+            result += REPLY_GAME_OVER;
+            result += game->score1 > game->score2 ? game->player1->name : game->player2->name;
+            result += REPLY_WINS_MATCH;
+            result += REPLY_PLAY_AGAIN;
+        } else {
+            result += REPLY_NEXT_ROUND;
+        }
+        for (Player* player : players) {
+            if (!isBinary(player)) {
+                sendMessage(player->session, result);
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (!isBinary(players[i])) {
+            continue;
+        }
+        // From this player's side: choices, outcome, scores
+        bool first = i == 0;
+        int outcome = winner == 0 ? BIN_TIE : ((winner == 1) == first ? BIN_WIN : BIN_LOSS);
+        char payload[6] = {
+            (char)(first ? game->choice1 : game->choice2),
+            (char)(first ? game->choice2 : game->choice1),
+            (char)outcome,
+            (char)(first ? game->score1 : game->score2),
+            (char)(first ? game->score2 : game->score1),
+            (char)(game_over ? BIN_FLAG_GAME_OVER : 0)
+        };
+        sendFrame(players[i], BIN_ROUND_RESULT, std::string_view(payload, sizeof(payload)));
+    }
+}
+
+// Stats of a player name (an in-memory lookup, the store is never read
+// after startup), new names start with DEFAULT_RATING and no record
+PlayerStats lookupStats(const std::string& name) {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    auto it = player_stats.find(name);
+    return it != player_stats.end() ? it->second : PlayerStats();
+}
+
+// Once a match is decided (forfeits included): Elo update and win/loss,
+// then both players' stats (with the rounds they played) are written back
+void recordMatchResult(Player* winner, Player* loser) {
+    const double K = 32;
+    double expected = 1.0 / (1.0 + std::pow(10.0, (loser->stats.rating - winner->stats.rating) / 400.0));
+    int change = (int)std::lround(K * (1.0 - expected));
+    winner->stats.rating += change;
+    loser->stats.rating -= change;
+    winner->stats.wins++;
+    loser->stats.losses++;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+    for (Player* player : {winner, loser}) {
+        player_stats[player->name] = player->stats;
+        if (stats_enabled) {
+            stats_pending.emplace_back(player->name, player->stats);
+        }
+    }
+}
+
+// ---- Timeouts ----
+
+// Wheel tick of the current time
+uint64_t currentTick() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        loop_now - wheel_started).count();
+    return elapsed / TIMER_TICK_MS;
+}
+
+// Starts (or restarts) the player's timeout of that kind, replacing the
+// one running. The queue timeout counts from queued_at, so it survives a
+// shard handoff
+void armTimer(Player* player, TimerKind kind) {
+    int64_t ms = 0;
+    uint64_t start = currentTick();
+    switch (kind) {
+        case TimerKind::IDLE: ms = idle_timeout_s * 1000LL; break;
+        case TimerKind::CHOICE: ms = choice_timeout_s * 1000LL; break;
+        case TimerKind::READY: ms = ready_timeout_s * 1000LL; break;
+        case TimerKind::QUEUE:
+            ms = queue_timeout_s * 1000LL;
+            start = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                player->queued_at - wheel_started).count()) / TIMER_TICK_MS;
+            break;
+        case TimerKind::LINE_END: ms = UNFRAMED_GRACE_MS; break;
+        case TimerKind::NONE: break;
+    }
+    if (ms <= 0) {
+        timing_wheel.cancel(player);
+        return;
+    }
+    timing_wheel.arm(player, kind, start + (uint64_t)ms / TIMER_TICK_MS);
+}
+
+// Snapshot bookkeeping and matches cut off by a crash (see Snapshots below)
+void markSnapshotDirty(Game* game);
+void snapshotGameEnded(Game* game);
+void rejoinInterruptedMatch(Player* player);
+void leaveInterruptedMatch(Player* player);
+size_t endInterruptedMatches(bool all);
+
+// Ends the loser's game as a forfeit (timed out or disconnected): history,
+// ratings, both players back to CONNECTED and the game freed. Returns the
+// opponent, the caller tells them why
+Player* forfeitGame(Player* loser, bool timed_out) {
+    Game* game = loser->game;
+    recordHistory(game, HIST_MATCH, HIST_FORFEIT | (loser == game->player1 ? HIST_FORFEIT_P1 : 0) |
+                                    (timed_out ? HIST_FORFEIT_TIMEOUT : 0));
+
+    // Players outlive their game, so the opponent is still connected
+    Player* opponent = (loser == game->player1) ? game->player2 : game->player1;
+
+    setState(opponent, PlayerState::CONNECTED);
+    opponent->game = nullptr;
+    armTimer(opponent, TimerKind::IDLE);
+    recordMatchResult(opponent, loser);
+
+    setState(loser, PlayerState::CONNECTED);
+    loser->game = nullptr;
+    addMetric(shard_metrics->games[(int)game->state], -1);
+    addMetric(timed_out ? shard_metrics->forfeits_timeout : shard_metrics->forfeits_disconnect);
+    snapshotGameEnded(game);
+    game_pool.destroy(game);
+    return opponent;
+}
+
+// Handles when player disconnects
+void handleDisconnect(SessionId session) {
+    PROFILE_SCOPE(PROFILE_DISCONNECT);
+    // Gets player info before
+    Player* player = findPlayer(session);
+    if (player == nullptr) {
+        LOG(WARNING) << "Warning: Tried to disconnect unknown session " << session;
+        return;
+    }
+    std::string name = player->name.empty() ? "Unknown" : player->name;
+
+    LOG(INFO) << name << " (session " << session << ") disconnected";
+    timing_wheel.cancel(player);
+
+    // ---- CASE 1: Player in Queue ----
+    // removes from matchmaking queue
+    if (player->in_queue) {
+        matchmaking_queue.remove(player);
+        LOG(INFO) << name << " removed from matchmaking queue";
+    }
+    if (player->resume_match != 0) {
+        leaveInterruptedMatch(player);
+    }
+
+    // ---- CASE 2: Player in Active Game ----
+    
+    //Checks if player was in a game
+    if (player->game != nullptr) {
+        // Notify opponent of disconnect, wins by forfeit
+        Player* opponent = forfeitGame(player, false);
+        sendOpponentLeft(opponent, name);
+        LOG(INFO) << "Game cleaned up due to disconnect";
+    }
+
+    // Ensures closing and erasing of player
+    // (the transport releases the connection first so it never holds a
+    // stale handle, and makes a last attempt at any queued output)
+    backend->closeSession(session);
+    addMetric(shard_metrics->players[(int)player->state], -1);
+    addMetric(shard_metrics->output_bytes, -(int64_t)player->pendingOutput());
+    addMetric(shard_metrics->disconnects);
+    player_pool.destroy(player);
+    removePlayer(session);
+}
+
+// Drops the players scheduled by disconnectLater()
+// (may grow while running, e.g. a forfeit notice to a slow opponent)
+void processPendingDisconnects() {
+    while (!pending_disconnects.empty()) {
+        ConnectionRef ref = pending_disconnects.back();
+        pending_disconnects.pop_back();
+        if (findPlayer(ref) != nullptr) { // may have disconnected on its own meanwhile
+            handleDisconnect(ref.session);
+        }
+    }
+}
+
+// Validates if player is in state, sends error if not
+bool requireState(Player* player, PlayerState required_state) {
+    PROFILE_SCOPE(PROFILE_REQUIRE_STATE);
+    if (player->state != required_state) {
+        // Gives conextual messages to player
+        sendWrongState(player);
+        return false;  // State check failed
+    }
+    return true;  // State is correct
+}
+
+// Rating gap a queued player accepts, widens the longer they wait
+const int MATCH_WINDOW_BASE = 100;
+const int MATCH_WINDOW_PER_SECOND = 25;
+const int MATCHMAKING_SWEEP_MS = 1000;  // re-check waiting players this often
+
+double waitedMs(Player* player, std::chrono::steady_clock::time_point now) {
+    return std::chrono::duration<double, std::milli>(now - player->queued_at).count();
+}
+
+int matchWindow(Player* player, std::chrono::steady_clock::time_point now) {
+    return MATCH_WINDOW_BASE + (int)(MATCH_WINDOW_PER_SECOND * waitedMs(player, now) / 1000);
+}
+
+// Creates a game for two queued players and notifies them
+void startMatch(Player* p1, Player* p2, std::chrono::steady_clock::time_point now) {
+    {
+        // Records wait time and rating gap (served by the admin endpoint)
+        double wait_ms = std::max(waitedMs(p1, now), waitedMs(p2, now));
+        int gap = std::abs(p1->stats.rating - p2->stats.rating);
+        addMetric(shard_metrics->match_wait_ms_sum, (int64_t)wait_ms);
+        maxMetric(shard_metrics->match_wait_ms_max, (int64_t)wait_ms);
+        addMetric(shard_metrics->match_rating_gap_sum, gap);
+        maxMetric(shard_metrics->match_rating_gap_max, gap);
+        LOG(INFO) << "Matched " << p1->name << " (" << p1->stats.rating << ") vs " << p2->name << " ("
+                  << p2->stats.rating << "), rating gap " << gap << ", waited " << (int)wait_ms << " ms";
+    }
+
+    // Remove players from queue
+    matchmaking_queue.remove(p1);
+    matchmaking_queue.remove(p2);
+
+    {
+        // Creates new game (both players point to same object)
+        Game *game = game_pool.create(p1, p2);
+        addMetric(shard_metrics->games[(int)game->state]);
+        addMetric(shard_metrics->matches);
+        game->match_id = next_match_id.fetch_add(1, std::memory_order_relaxed);
+        p1->game = game;
+        p2->game = game;
+        markSnapshotDirty(game);
+
+        // Updates states
+        setState(p1, PlayerState::IN_GAME_CHOOSING);
+        setState(p2, PlayerState::IN_GAME_CHOOSING);
+
+        // Notify both players
+        sendMatchFound(p1, p2);
+        sendMatchFound(p2, p1);
+        armTimer(p1, TimerKind::CHOICE);
+        armTimer(p2, TimerKind::CHOICE);
+    }
+}
+
+// Pairs players within an edge bucket, which clamps every rating beyond
+// it and so has no bound on the gap: each one, oldest first, takes the
+// oldest later player inside its window
+void pairEdgeBucket(PlayerQueue& bucket, std::chrono::steady_clock::time_point now) {
+    Player* p1 = bucket.front();
+    while (p1 != nullptr) {
+        int window = matchWindow(p1, now);
+        Player* p2 = p1->queue_next;
+        while (p2 != nullptr && std::abs(p1->stats.rating - p2->stats.rating) > window) {
+            p2 = p2->queue_next;
+        }
+        Player* next = p1->queue_next;
+        if (p2 != nullptr) {
+            if (next == p2) {
+                next = p2->queue_next;
+            }
+            startMatch(p1, p2, now);
+        }
+        p1 = next;
+    }
+}
+
+// Pairs queued players by rating proximity
+// Two players in the same inner bucket are always within the base window,
+// so those pair off first (oldest first). The clamped edge buckets are
+// gap-checked instead. That leaves one player per inner bucket (and the
+// unpaired ones of the edges), and each of them, longest waiting first,
+// looks outwards through the neighbouring buckets for the closest rating
+// inside its window.
+// Cost depends on the number of buckets, not on the queue length
+void tryMatchPlayers() {
+    if (matchmaking_queue.size() < 2) {
+        return;
+    }
+    auto now = loop_now;
+    const int last = MatchmakingQueue::NUM_BUCKETS - 1;
+
+    for (int i = 0; i <= last; i++) {
+        PlayerQueue& bucket = matchmaking_queue.buckets[i];
+        if (i == 0 || i == last) {
+            pairEdgeBucket(bucket, now);
+            continue;
+        }
+        while (bucket.size() >= 2) {
+            Player* p1 = bucket.front();
+            startMatch(p1, p1->queue_next, now);
+        }
+    }
+
+    std::vector<Player*> waiting;
+    for (int i = 0; i <= last; i++) {
+        Player* player = matchmaking_queue.buckets[i].front();
+        if (i == 0 || i == last) {
+            for (; player != nullptr; player = player->queue_next) {
+                waiting.push_back(player);
+            }
+        } else if (player != nullptr) {
+            waiting.push_back(player);
+        }
+    }
+    std::sort(waiting.begin(), waiting.end(), [](Player* a, Player* b) {
+        return a->queued_at < b->queued_at;
+    });
+
+    for (Player* player : waiting) {
+        if (!player->in_queue) {
+            continue; // already taken by an earlier player
+        }
+        int window = matchWindow(player, now);
+        Player* best = nullptr;
+        int best_gap = 0;
+
+        // Buckets further than the window can't hold a close enough rating
+        for (int distance = 1; distance < MatchmakingQueue::NUM_BUCKETS; distance++) {
+            if ((distance - 1) * MatchmakingQueue::BUCKET_WIDTH > window) {
+                break;
+            }
+            for (int bucket : {player->queue_bucket - distance, player->queue_bucket + distance}) {
+                if (bucket < 0 || bucket >= MatchmakingQueue::NUM_BUCKETS) {
+                    continue;
+                }
+                Player* candidate = matchmaking_queue.buckets[bucket].front();
+                if (candidate == nullptr) {
+                    continue;
+                }
+                int gap = std::abs(player->stats.rating - candidate->stats.rating);
+                if (gap <= window && (best == nullptr || gap < best_gap)) {
+                    best = candidate;
+                    best_gap = gap;
+                }
+            }
+        }
+        if (best != nullptr) {
+            startMatch(player, best, now);
+        }
+    }
+}
+
+// Matchmaking stage of the loop: pairs the whole batch of new joins in one
+// pass, and re-checks waiting players once a second so windows widen.
+// The MATCH FOUND messages go out in the flush that follows
+void runMatchmaking() {
+    auto now = loop_now;
+    auto since_last = now - last_match_pass;
+    bool batch_due = matchmaking_pending && since_last >= std::chrono::milliseconds(match_interval_ms);
+    bool sweep_due = matchmaking_queue.size() >= 2 && since_last >= std::chrono::milliseconds(MATCHMAKING_SWEEP_MS);
+    if (!batch_due && !sweep_due) {
+        return;
+    }
+    tryMatchPlayers();
+    matchmaking_pending = false;
+    last_match_pass = now;
+}
+
+// How long the loop may wait for events before the next matchmaking pass is due
+// (on the loop clock, like the stages it schedules)
+int matchmakingTimeout() {
+    int due_ms;
+    if (matchmaking_pending) {
+        due_ms = match_interval_ms;
+    } else if (matchmaking_queue.size() >= 2) {
+        due_ms = MATCHMAKING_SWEEP_MS;
+    } else {
+        return -1;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        loop_now - last_match_pass).count();
+    return std::max(0, due_ms - (int)elapsed);
+}
+
+void startUnframed(Player* player);   // with the text input handling below
+
+// A player's timeout ran out (already disarmed when this runs)
+void onTimerExpired(Player* player, TimerKind kind) {
+    if (player->closing) {
+        return;
+    }
+    if (kind == TimerKind::LINE_END) {
+        startUnframed(player);
+        return;
+    }
+    addMetric(shard_metrics->timeouts[(int)kind]);
+    switch (kind) {
+        case TimerKind::IDLE:
+            LOG(INFO) << (player->name.empty() ? "Unknown" : player->name) << " (session " << player->session
+                      << ") idle for " << idle_timeout_s << " s, disconnecting";
+            sendTimedOut(player, BIN_TIMEOUT_IDLE, REPLY_IDLE_TIMED_OUT);
+            disconnectLater(player->session);
+            break;
+
+        case TimerKind::QUEUE:
+            LOG(INFO) << player->name << " left the queue, no match in " << queue_timeout_s << " s";
+            matchmaking_queue.remove(player);
+            if (player->resume_match != 0) {
+                leaveInterruptedMatch(player);
+            }
+            setState(player, PlayerState::CONNECTED);
+            sendTimedOut(player, BIN_TIMEOUT_QUEUE, REPLY_QUEUE_TIMED_OUT);
+            armTimer(player, TimerKind::IDLE);
+            break;
+
+        case TimerKind::CHOICE:
+        case TimerKind::READY: {
+            // The player holding up the game forfeits it
+            LOG(INFO) << player->name << " timed out " << (kind == TimerKind::CHOICE ? "choosing" : "getting ready")
+                      << ", forfeits the match";
+            Player* opponent = forfeitGame(player, true);
+            sendTimedOut(player, kind == TimerKind::CHOICE ? BIN_TIMEOUT_CHOICE : BIN_TIMEOUT_READY, REPLY_TIMED_OUT);
+            sendOpponentTimedOut(opponent, player->name);
+            armTimer(player, TimerKind::IDLE);
+            break;
+        }
+
+        case TimerKind::LINE_END:   // handled above
+        case TimerKind::NONE:
+            break;
+    }
+}
+
+// Timer stage of the loop: moves the wheel up to the current tick, firing
+// whatever expired on the way
+void advanceTimers() {
+    uint64_t target = currentTick();
+    if (timing_wheel.count == 0) {
+        timing_wheel.now_tick = target; // nothing to fire, skips ahead
+        return;
+    }
+    while (timing_wheel.now_tick < target) {
+        timing_wheel.advance(onTimerExpired);
+    }
+}
+
+// How long the loop may wait for events: until the next matchmaking pass
+// or, while any timer is armed, the next wheel tick
+int loopTimeout() {
+    int timeout = matchmakingTimeout();
+    if (timing_wheel.count > 0) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            loop_now - wheel_started).count();
+        int tick_ms = std::max(0, (int)((timing_wheel.now_tick + 1) * TIMER_TICK_MS - elapsed));
+        timeout = timeout < 0 ? tick_ms : std::min(timeout, tick_ms);
+    }
+    return timeout;
+}
+
+
+// Handles 'join' -> adds player to queue and match
+void handleJoinCommand(Player* player) {
+    PROFILE_SCOPE(PROFILE_JOIN);
+    setState(player, PlayerState::IN_QUEUE);
+    player->queued_at = loop_now;
+    matchmaking_queue.push(player);
+    armTimer(player, TimerKind::QUEUE);
+
+    sendReply(player, BIN_JOINED, REPLY_JOINED);
+
+    matchmaking_pending = true;
+}
+
+// Handles rock/paper/scissors choice -> stores choice and checks for both chosen
+void handleChoiceCommand(Player* player, Choice choice) {
+    PROFILE_SCOPE(PROFILE_CHOICE);
+
+    Game *game = player->game;
+    timing_wheel.cancel(player);
+
+    // Stores choice based on player
+    if (player == game->player1)
+    {
+        game->choice1 = choice;
+
+        setState(player, PlayerState::IN_GAME_WAITING);
+        sendReply(player, BIN_CHOICE_LOCKED, REPLY_CHOICE_LOCKED);
+    }
+    else
+    {
+        game->choice2 = choice;
+
+        setState(player, PlayerState::IN_GAME_WAITING);
+        sendReply(player, BIN_CHOICE_LOCKED, REPLY_CHOICE_LOCKED);
+    }
+
+    // if both players have chosen, resolves the current round
+    if (game->bothChosen())
+    {
+        // Determines who won
+        int winner = game->getRoundWinner();
+
+        // Updates scores
+        if (winner == 1)
+            game->score1++;
+        if (winner == 2)
+            game->score2++;
+        game->round++;
+        addMetric(shard_metrics->rounds);
+        recordHistory(game, HIST_ROUND);
+
+        // Round stats go to the players' own copies, saved when the match ends
+        game->player1->stats.choices[(int)game->choice1 - 1]++;
+        game->player2->stats.choices[(int)game->choice2 - 1]++;
+        if (winner == 0) {
+            game->player1->stats.ties++;
+            game->player2->stats.ties++;
+        }
+
+        setGameState(game, GameState::ROUND_COMPLETE);
+
+        // Checks if the game is over
+        if (game->isGameOver()) {
+            setGameState(game, GameState::GAME_OVER);
+            recordHistory(game, HIST_MATCH);
+
+            // Send to both
+            sendRoundResult(game, winner);
+
+            // Resets players to CONNECTED state
+            Player *p1 = game->player1;
+            Player *p2 = game->player2;
+            if (game->score1 > game->score2) {
+                recordMatchResult(p1, p2);
+            } else {
+                recordMatchResult(p2, p1);
+            }
+            setState(p1, PlayerState::CONNECTED);
+            setState(p2, PlayerState::CONNECTED);
+            armTimer(p1, TimerKind::IDLE);
+            armTimer(p2, TimerKind::IDLE);
+
+            // Cleans up the game
+            p1->game = nullptr;
+            p2->game = nullptr;
+            addMetric(shard_metrics->games[(int)game->state], -1);
+            snapshotGameEnded(game);
+            game_pool.destroy(game);
+        } else {
+            // Proceeds to Next Round
+            markSnapshotDirty(game);
+            sendRoundResult(game, winner);
+
+            // Updates states to viewing results
+            Player *p1 = game->player1;
+            Player *p2 = game->player2;
+            setState(p1, PlayerState::VIEWING_RESULTS);
+            setState(p2, PlayerState::VIEWING_RESULTS);
+            armTimer(p1, TimerKind::READY);
+            armTimer(p2, TimerKind::READY);
+        }
+    }
+}
+
+// Handles 'ready' -> starts next round when both players ready
+void handleReadyCommand(Player* player) {
+    PROFILE_SCOPE(PROFILE_READY);
+    Game *game = player->game;
+
+    // Marks the player as ready
+    setState(player, PlayerState::IN_GAME_CHOOSING);
+
+    Player *p1 = game->player1;
+    Player *p2 = game->player2;
+
+    // if both players are ready, starts new round
+    if (p1->state == PlayerState::IN_GAME_CHOOSING &&
+        p2->state == PlayerState::IN_GAME_CHOOSING) {
+        setGameState(game, GameState::ROUND_ACTIVE);
+        game->resetRound();
+
+        sendReply(p1, BIN_NEW_ROUND, REPLY_NEW_ROUND);
+        sendReply(p2, BIN_NEW_ROUND, REPLY_NEW_ROUND);
+        armTimer(p1, TimerKind::CHOICE);
+        armTimer(p2, TimerKind::CHOICE);
+    } else {
+        // This player is ready, waiting on their opponent (whose timer keeps running)
+        timing_wheel.cancel(player);
+        sendReply(player, BIN_READY_WAITING, REPLY_READY_WAITING);
+    }
+}
+
+// ------------------- Command Dispatch -------------------
+// Text and binary commands both become an opcode (BinaryOp) plus a one-byte
+// argument (the choice), run through one handler table
+
+typedef void (*CommandHandler)(Player* player, uint8_t arg);
+
+void runJoin(Player* player, uint8_t) {
+    // Player is looking to join matchmaking
+    if (requireState(player, PlayerState::CONNECTED)) {
+        handleJoinCommand(player);
+    }
+}
+
+void runChoice(Player* player, uint8_t choice) {
+    // player choosing
+    if (requireState(player, PlayerState::IN_GAME_CHOOSING)) {
+        handleChoiceCommand(player, (Choice)choice);
+    }
+}
+
+void runReady(Player* player, uint8_t) {
+    // Player is ready for next round
+    if (requireState(player, PlayerState::VIEWING_RESULTS)) {
+        handleReadyCommand(player);
+    }
+}
+
+void runQuit(Player* player, uint8_t) {
+    sendReply(player, BIN_GOODBYE, REPLY_GOODBYE);
+    handleDisconnect(player->session);
+}
+
+// Indexed by opcode (hello is only valid as the first message)
+const CommandHandler COMMAND_HANDLERS[] = {nullptr, nullptr, runJoin, runChoice, runReady, runQuit};
+const int NUM_OPCODES = sizeof(COMMAND_HANDLERS) / sizeof(COMMAND_HANDLERS[0]);
+
+// Text command words, matched case-insensitively
+struct TextCommand {
+    const char* word;
+    int length;
+    uint8_t op;
+    uint8_t arg;
+};
+constexpr TextCommand TEXT_COMMANDS[] = {
+    {"join", 4, BIN_JOIN, 0},
+    {"rock", 4, BIN_CHOICE, BIN_ROCK},
+    {"paper", 5, BIN_CHOICE, BIN_PAPER},
+    {"scissors", 8, BIN_CHOICE, BIN_SCISSORS},
+    {"ready", 5, BIN_READY, 0},
+    {"quit", 4, BIN_QUIT, 0},
+};
+const int NUM_TEXT_COMMANDS = sizeof(TEXT_COMMANDS) / sizeof(TEXT_COMMANDS[0]);
+
+// Perfect hash over (lowercased first byte, length): every word above gets its
+// own slot, checked at compile time, so a lookup is one table read plus one
+// compare of that candidate
+constexpr unsigned commandHash(unsigned char first, int length) {
+    return ((first | 0x20) + 3 * length) & 15;
+}
+
+struct CommandHashTable {
+    int8_t slots[16];     // index into TEXT_COMMANDS, -1 = no word
+    bool collision;
+};
+
+constexpr CommandHashTable buildCommandHashTable() {
+    CommandHashTable table = {};
+    for (int i = 0; i < 16; i++) {
+        table.slots[i] = -1;
+    }
+    for (int i = 0; i < NUM_TEXT_COMMANDS; i++) {
+        unsigned slot = commandHash(TEXT_COMMANDS[i].word[0], TEXT_COMMANDS[i].length);
+        table.collision |= table.slots[slot] != -1;
+        table.slots[slot] = i;
+    }
+    return table;
+}
+
+constexpr CommandHashTable COMMAND_HASH_TABLE = buildCommandHashTable();
+static_assert(!COMMAND_HASH_TABLE.collision, "commandHash must give every text command its own slot");
+
+// Raw line bytes -> command, nullptr if not a command. '| 0x20' lowercases
+// ASCII letters in place (the words are all lowercase letters, and no other
+// byte turns into one)
+const TextCommand* findTextCommand(const char* text, int length) {
+    if (length == 0 || length > 8) {
+        return nullptr;
+    }
+    int index = COMMAND_HASH_TABLE.slots[commandHash(text[0], length)];
+    if (index < 0 || TEXT_COMMANDS[index].length != length) {
+        return nullptr;
+    }
+    const char* word = TEXT_COMMANDS[index].word;
+    for (int i = 0; i < length; i++) {
+        if ((text[i] | 0x20) != word[i]) {
+            return nullptr;
+        }
+    }
+    return &TEXT_COMMANDS[index];
+}
+
+void runCommand(Player* player, uint8_t op, uint8_t arg) {
+    if (op < NUM_OPCODES && COMMAND_HANDLERS[op] != nullptr) {
+        COMMAND_HANDLERS[op](player, arg);
+    } else {
+        sendUnknownCommand(player);
+    }
+}
+
+// ------------------- Shard Handoff -------------------
+
+thread_local SessionId paused_session = -1;  // lone player waiting for its I/O to settle before a handoff
+
+// A player whose I/O is paused (pauseReading returned true) goes to the
+// target shard's inbox
+void handPlayerOver(Player* player, int target_id) {
+    timing_wheel.cancel(player); // the target re-arms it from queued_at
+    SessionId session = player->session;
+    int handle = backend->detachSession(session);
+    removePlayer(session);
+    player->output_dirty = false; // our dirty_outputs entry goes stale, the target lists it again
+    addMetric(shard_metrics->players[(int)player->state], -1);
+    addMetric(shard_metrics->output_bytes, -(int64_t)player->pendingOutput());
+
+    std::string name = player->name;
+    Shard* target = shards[target_id];
+    {
+        std::lock_guard<std::mutex> inbox_guard(target->inbox_lock);
+        target->inbox.push_back(HandedPlayer{std::move(*player), handle});
+    }
+    player_pool.destroy(player);
+    uint64_t one = 1;
+    if (write(target->wakeup_fd, &one, sizeof(one)) < 0) {
+        LOG(ERROR) << "Shard wakeup failed!";
+    }
+    LOG(INFO) << name << " handed from shard " << current_shard->id << " to shard " << target_id;
+}
+
+// The handoff got called off (player matched, left or the advert went away)
+void resumePausedPlayer() {
+    if (paused_session != -1) {
+        backend->resumeReading(paused_session);
+        paused_session = -1;
+    }
+}
+
+// Runs after every loop iteration: a shard left with exactly one queued
+// player either advertises it in the lobby or, if another shard already
+// advertises one, hands its player over so the two can be matched there.
+// Games are always created by the shard that owns both players
+void balanceLonePlayer() {
+    if (shards.size() < 2 || upgrade_requested.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int my_id = current_shard->id;
+    bool lone = matchmaking_queue.size() == 1;
+    int advertised = lobby_shard.load(std::memory_order_relaxed);
+
+    // Cheap exit for the common case, the lock is only taken on changes
+    if (lone == (advertised == my_id) && paused_session == -1) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(lobby_lock);
+    advertised = lobby_shard.load(std::memory_order_relaxed);
+    if (!lone) {
+        // Our player got matched or left, withdraws the advert
+        resumePausedPlayer();
+        if (advertised == my_id) {
+            lobby_shard.store(-1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    if (advertised == -1 || advertised == my_id) {
+        resumePausedPlayer();
+        lobby_shard.store(my_id, std::memory_order_relaxed);
+        return;
+    }
+
+    // Another shard is waiting, moves our player over to it. Its reads are
+    // paused first and it only leaves once the transport has nothing of it
+    // in flight (reads already under way delivered here, last send done),
+    // checked again every iteration until then
+    Player* player = matchmaking_queue.front();
+    if (player->session != paused_session) {
+        resumePausedPlayer();
+        paused_session = player->session;
+    }
+    if (!backend->pauseReading(player->session)) {
+        return;
+    }
+    paused_session = -1;
+    lobby_shard.store(-1, std::memory_order_relaxed);
+    matchmaking_queue.remove(player);
+    handPlayerOver(player, advertised);
+}
+
+// Players going back into an interrupted match whose opponent waits on
+// another shard (see rejoinInterruptedMatch), with that shard's id. Moved
+// the same way once their I/O is paused
+thread_local std::vector<std::pair<ConnectionRef, int>> resume_moves;
+
+void moveResumingPlayers() {
+    if (resume_moves.empty() || upgrade_requested.load(std::memory_order_relaxed)) {
+        return;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < resume_moves.size(); i++) {
+        Player* player = findPlayer(resume_moves[i].first);
+        if (player == nullptr || player->closing) {
+            continue;
+        }
+        if (player->resume_match == 0) {
+            backend->resumeReading(player->session); // stopped waiting meanwhile
+            continue;
+        }
+        if (!backend->pauseReading(player->session)) {
+            resume_moves[kept++] = resume_moves[i];
+            continue;
+        }
+        handPlayerOver(player, resume_moves[i].second);
+    }
+    resume_moves.resize(kept);
+}
+
+// Adopts players other shards handed over and tries to match them
+void onShardWakeup() {
+    uint64_t count;
+    if (read(current_shard->wakeup_fd, &count, sizeof(count)) < 0) {
+        return; // nothing pending
+    }
+
+    std::vector<HandedPlayer> arrived;
+    {
+        std::lock_guard<std::mutex> lock(current_shard->inbox_lock);
+        arrived.swap(current_shard->inbox);
+    }
+    for (HandedPlayer& moved : arrived) {
+        Player* player = player_pool.create(std::move(moved.player));
+        player->session = openSession(moved.handle);
+        addPlayer(player);
+        backend->adoptClient(player->session);
+        addMetric(shard_metrics->players[(int)player->state]);
+        addMetric(shard_metrics->output_bytes, player->pendingOutput());
+        if (player->resume_match != 0) {
+            rejoinInterruptedMatch(player);
+        } else {
+            matchmaking_queue.push(player);
+            armTimer(player, TimerKind::QUEUE);
+        }
+        if (player->pendingOutput() > 0) {
+            queueFlush(player); // output the old shard could not write yet
+        }
+    }
+    matchmaking_pending = true;
+}
+
+// Opens a session and creates its player for a connection the backend just
+// accepted, handle is the backend's own id for it (the socket)
+SessionId onClientConnected(int handle) {
+    SessionId session = openSession(handle);
+    journalEvent(JOURNAL_CONNECT, session);
+    Player* player = player_pool.create(session, "");
+    addPlayer(player);
+    addMetric(shard_metrics->players[(int)player->state]);
+    addMetric(shard_metrics->connects);
+    armTimer(player, TimerKind::IDLE);
+
+    LOG(INFO) << "New client connected (session " << session << ")";
+    return session;
+}
+
+// The backend saw the peer close the connection (or a read fail)
+void onClientClosed(SessionId session) {
+    journalEvent(JOURNAL_CLOSED, session);
+    handleDisconnect(session);
+}
+
+// The backend could not send to the peer, it is gone
+void onSendFailed(SessionId session) {
+    journalEvent(JOURNAL_DROPPED, session);
+    disconnectLater(session);
+}
+
+// First message of a connection (either protocol): the username
+void setPlayerName(Player* player, const std::string& name) {
+    player->name = name;
+    player->stats = lookupStats(player->name);
+    if (history_fd >= 0) {
+        player->name_id = internName(player->name);
+    }
+    LOG(INFO) << name << " has connected! (rating " << player->stats.rating << ")";
+
+    // Send game instructions
+    sendWelcome(player);
+    rejoinInterruptedMatch(player);
+}
+
+// Handles one complete line from a player (username first, then commands).
+// Works on the line where it sits in the input buffer, nothing is copied
+void handleCommand(Player* player, const char* line, int length) {
+    // strips trailing newline/whitespace
+    while (length > 0 && strchr(" \n\r\t", line[length - 1]) != NULL) {
+        length--;
+    }
+    if (length == 0) {
+        return; // blank line
+    }
+
+    if (player->name.empty()) {
+        // This is the username
+        setPlayerName(player, std::string(line, length));
+        return;
+    }
+
+    const TextCommand* command = findTextCommand(line, length);
+    if (command == nullptr) {
+        LOG(DEBUG) << player->name << " sent: " << std::string_view(line, length);
+
+        // Not valid command -> gives contextual help
+        sendUnknownCommand(player);
+        return;
+    }
+    LOG(DEBUG) << player->name << " sent: " << command->word;
+    runCommand(player, command->op, command->arg);
+}
+
+// Handles one binary frame (see binary_protocol.h), dispatched through the
+// same handler table as the text commands
+void handleBinaryCommand(SessionId session, Player* player, uint8_t op, const char* payload, uint32_t len) {
+    if (player->name.empty()) {
+        if (op != BIN_HELLO || len == 0 || len > BIN_MAX_NAME) {
+            LOG(WARNING) << "Session " << session << " sent no valid hello frame, disconnecting";
+            disconnectLater(session);
+            return;
+        }
+        setPlayerName(player, std::string(payload, len));
+        return;
+    }
+
+    LOG(DEBUG) << player->name << " sent opcode " << (int)op;
+
+    // The only argument is a choice
+    uint8_t arg = 0;
+    if (op == BIN_CHOICE) {
+        arg = len == 1 ? (uint8_t)payload[0] : 0;
+        if (arg < BIN_ROCK || arg > BIN_SCISSORS) {
+            sendUnknownCommand(player);
+            return;
+        }
+    }
+    runCommand(player, op, arg);
+}
+
+// Buffers binary input and runs every complete frame
+void handleBinaryInput(SessionId session, Player* player, const char* data, int len) {
+    ConnectionRef ref = refOf(player);
+
+    while (len > 0) {
+        int chunk = std::min(len, Player::INPUT_BUFFER_SIZE - player->input_len);
+        memcpy(player->input + player->input_len, data, chunk);
+        player->input_len += chunk;
+        data += chunk;
+        len -= chunk;
+
+        // Runs each complete frame
+        int start = 0;
+        while (start < player->input_len) {
+            uint8_t op;
+            const char* payload;
+            uint32_t payload_len;
+            size_t frame_len;
+            int parsed = parseFrame(player->input + start, player->input_len - start,
+                                    op, payload, payload_len, frame_len);
+            if (parsed == 0) {
+                break; // partial frame
+            }
+            if (parsed < 0) {
+                // A frame always fits the buffer, so this is a broken client
+                LOG(WARNING) << "Malformed frame from session " << session << ", disconnecting";
+                disconnectLater(session);
+                return;
+            }
+            handleBinaryCommand(session, player, op, payload, payload_len);
+
+            // 'quit' may have removed the player
+            if (findPlayer(ref) == nullptr || player->closing) {
+                return;
+            }
+            start += frame_len;
+        }
+
+        // Keeps the partial frame at the front of the buffer
+        player->input_len -= start;
+        memmove(player->input, player->input + start, player->input_len);
+    }
+}
+
+// Buffers text input and runs every complete '\n'-terminated line, so
+// pipelined commands all get handled
+void handleTextInput(SessionId session, Player* player, const char* data, int len) {
+    ConnectionRef ref = refOf(player);
+
+    while (len > 0) {
+        // Copies as much as fits after the partial line already buffered
+        int chunk = std::min(len, Player::INPUT_BUFFER_SIZE - player->input_len);
+        memcpy(player->input + player->input_len, data, chunk);
+        player->input_len += chunk;
+        data += chunk;
+        len -= chunk;
+
+        // Runs each complete line
+        int start = 0;
+        while (start < player->input_len) {
+            char* newline = (char*)memchr(player->input + start, '\n', player->input_len - start);
+            if (newline == NULL) {
+                break;
+            }
+            int end = newline - player->input;
+            if (player->input_overflow) {
+                player->input_overflow = false; // tail of an oversized line, drops it
+            } else {
+                handleCommand(player, player->input + start, end - start);
+
+                // 'quit' may have removed the player
+                if (findPlayer(ref) == nullptr) {
+                    return;
+                }
+            }
+            start = end + 1;
+        }
+
+        // Keeps the partial line at the front of the buffer
+        player->input_len -= start;
+        memmove(player->input, player->input + start, player->input_len);
+
+        // Buffer full without a newline -> line too long, discards up to the next '\n'
+        if (player->input_len == Player::INPUT_BUFFER_SIZE) {
+            player->input_len = 0;
+            if (!player->input_overflow) {
+                player->input_overflow = true;
+                sendMessage(session, REPLY_TOO_LONG);
+            }
+        }
+    }
+
+    if (player->protocol == Protocol::TEXT_UNFRAMED) {
+        // Whatever is left of the read is a command of its own
+        int length = player->input_len;
+        bool overflow = player->input_overflow;
+        player->input_len = 0;
+        player->input_overflow = false;
+        if (length > 0 && !overflow) {
+            handleCommand(player, player->input, length);
+        }
+    } else if (player->name.empty() && player->input_len > 0 && !player->input_overflow) {
+        // Username still open, gives its '\n' a moment to arrive
+        if (player->timer_kind != TimerKind::LINE_END) {
+            armTimer(player, TimerKind::LINE_END);
+        }
+    } else if (player->timer_kind == TimerKind::LINE_END) {
+        armTimer(player, TimerKind::IDLE);
+    }
+}
+
+// A first line that got no '\n' within UNFRAMED_GRACE_MS: a client from
+// before line framing, which sends every message as one unterminated
+// write. The buffered bytes are its username and each later read is taken
+// as one command, like the server used to read them
+void startUnframed(Player* player) {
+    player->protocol = Protocol::TEXT_UNFRAMED;
+    int length = player->input_len;
+    player->input_len = 0;
+    handleCommand(player, player->input, length);
+    if (player->state == PlayerState::CONNECTED) {
+        armTimer(player, TimerKind::IDLE); // unless back waiting for an interrupted match
+    }
+}
+
+// Handles data the backend read from a session. The first byte of a
+// connection picks the protocol: BINARY_PROTOCOL_MAGIC for binary frames,
+// anything else is a text client such as player.cpp
+void handleClientMessage(SessionId session, const char* data, int len) {
+    journalEvent(JOURNAL_DATA, session, data, len > 0 ? len : 0);
+
+    // verify player still exists
+    Player* player = findPlayer(session);
+    if (player == nullptr || len <= 0) {
+        return;
+    }
+
+    // Any input counts as activity while connected but not playing
+    if (player->timer_kind == TimerKind::IDLE) {
+        armTimer(player, TimerKind::IDLE);
+    }
+
+    if (player->protocol == Protocol::UNKNOWN) {
+        if ((uint8_t)data[0] == BINARY_PROTOCOL_MAGIC) {
+            player->protocol = Protocol::BINARY;
+            data++;
+            len--;
+        } else {
+            player->protocol = Protocol::TEXT;
+        }
+    }
+
+    if (player->protocol == Protocol::BINARY) {
+        handleBinaryInput(session, player, data, len);
+    } else {
+        handleTextInput(session, player, data, len);
+    }
+}
+
+// ------------------- Event Backends -------------------
+
+// ---- epoll backend ----
+// Readiness-based: sockets are registered once at accept and only the ready
+// ones come back from epoll_wait(), then read() / send() are done here
+struct EpollBackend : EventBackend {
+    int epoll_fd = -1;
+    int server_fd = -1;
+    int wakeup_fd = -1;
+
+    static const int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+
+    std::vector<bool> write_watched;   // fd -> EPOLLOUT currently registered
+    std::vector<SessionId> sessions;   // fd -> its session while watched
+
+    ~EpollBackend() {
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    const char* name() override { return "epoll"; }
+
+    bool init(int listen_fd) override {
+        server_fd = listen_fd;
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            return false;
+        }
+
+        // Watch server socket for new connections
+        epoll_event server_event;
+        server_event.events = EPOLLIN;
+        server_event.data.fd = server_fd;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &server_event) == 0;
+    }
+
+    // Reads happen right in the loop, so nothing is ever left in flight
+    bool pauseReading(SessionId) override { return true; }
+    void resumeReading(SessionId) override {}
+
+    int detachSession(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket < 0) {
+            return -1;
+        }
+        // Last non-blocking attempt at queued output (e.g. "Goodbye!")
+        Player* player = findPlayer(session);
+        if (player != nullptr && player->pendingOutput() > 0) {
+            writeOutput(socket, player);
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+        if (socket < (int)write_watched.size()) {
+            write_watched[socket] = false;
+        }
+        if (socket < (int)sessions.size()) {
+            sessions[socket] = -1;
+        }
+        return socket;
+    }
+
+    void closeSession(SessionId session) override {
+        int socket = detachSession(session);
+        if (socket >= 0) {
+            close(socket);
+        }
+    }
+
+    void adoptClient(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (watchClient(socket)) {
+            trackSession(socket, session);
+        }
+    }
+
+    // Registers the client once, it stays watched until its session ends
+    bool watchClient(int socket) {
+        epoll_event client_event;
+        client_event.events = EPOLLIN;
+        client_event.data.fd = socket;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &client_event) < 0) {
+            LOG(ERROR) << "epoll_ctl failed for socket " << socket;
+            return false;
+        }
+        return true;
+    }
+
+    void trackSession(int socket, SessionId session) {
+        if (socket >= (int)sessions.size()) {
+            sessions.resize(socket + 1, -1);
+        }
+        sessions[socket] = session;
+    }
+
+    void watchWakeup(int event_fd) override {
+        wakeup_fd = event_fd;
+        epoll_event wakeup_event;
+        wakeup_event.events = EPOLLIN;
+        wakeup_event.data.fd = wakeup_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &wakeup_event);
+    }
+
+    void flush(Player* player) override {
+        int socket = sessionHandle(player->session);
+        if (!writeOutput(socket, player)) {
+            onSendFailed(player->session);
+            return;
+        }
+        // Leftover output -> waits for EPOLLOUT, drained -> stops watching it
+        watchWritable(socket, player->pendingOutput() > 0);
+    }
+
+    // Writes as much queued output as the socket takes, false on a socket error
+    bool writeOutput(int socket, Player* player) {
+        PROFILE_SCOPE(PROFILE_SEND);
+        while (player->pendingOutput() > 0) {
+            ssize_t sent = send(socket, player->output.data() + player->output_sent,
+                                player->pendingOutput(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent > 0) {
+                player->output_sent += sent;
+                addMetric(shard_metrics->output_bytes, -sent);
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break; // socket buffer full
+            } else {
+                return false;
+            }
+        }
+        if (player->pendingOutput() == 0) {
+            player->output.clear(); // keeps the capacity for the next replies
+            player->output_sent = 0;
+        }
+        return true;
+    }
+
+    void watchWritable(int socket, bool enable) {
+        if (socket >= (int)write_watched.size()) {
+            write_watched.resize(socket + 1, false);
+        }
+        if (write_watched[socket] == enable) {
+            return;
+        }
+        write_watched[socket] = enable;
+        epoll_event client_event;
+        client_event.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        client_event.data.fd = socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &client_event);
+    }
+
+    // Nothing is read unless runOnce() is called, and unsent output stays
+    // in the players' queues, so there is never anything in flight
+    void stopReading() override {}
+    bool busy() override { return false; }
+
+    void runOnce(int timeout_ms) override {
+        // Block until activity on any socket (or the timeout)
+        int ready;
+        {
+            PROFILE_SCOPE(PROFILE_WAIT);
+            ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+        }
+        loop_now = std::chrono::steady_clock::now();
+
+        if (ready < 0) { // Calls error if wait was interrupted or failed
+            if (errno != EINTR) {
+                LOG(ERROR) << "epoll_wait error";
+            }
+            return; // Attempts call again
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int socket = events[i].data.fd;
+
+            // Checks if server socket has activity
+            if (socket == server_fd) {
+                acceptClient();
+                continue;
+            }
+
+            // Another shard handed players over
+            if (socket == wakeup_fd) {
+                onShardWakeup();
+                continue;
+            }
+
+            // verify player still exists
+            SessionId session = socket < (int)sessions.size() ? sessions[socket] : -1;
+            Player* player = findPlayer(session);
+            if (player == nullptr) {
+                continue;
+            }
+
+            // Socket drained enough to take more queued output
+            if (events[i].events & EPOLLOUT) {
+                queueFlush(player);
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+
+            // Reads data from given player
+            const int BUFFER_SIZE = 1024;
+            char buffer[BUFFER_SIZE];
+            int valread = read(socket, buffer, BUFFER_SIZE);
+
+            // Checks for disconnection
+            if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue; // nothing to read after all
+            }
+            if (valread <= 0) { // if 0 = disconnection, 0 > means error
+                onClientClosed(session);
+            } else {
+                handleClientMessage(session, buffer, valread);
+            }
+        }
+    }
+
+    void acceptClient() {
+        // accepts client through creating new socket for the connection
+        // (non-blocking, so a client that stops reading never stalls a send)
+        int new_socket = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (new_socket < 0) { // catches if not valid client
+            LOG(ERROR) << "Accept failed!";
+            return;
+        }
+
+        // Replies are already coalesced into one write per loop iteration,
+        // so Nagle would only add delay
+        int opt = 1;
+        setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        if (!watchClient(new_socket)) {
+            close(new_socket);
+            return;
+        }
+        trackSession(new_socket, onClientConnected(new_socket));
+    }
+};
+
+// ---- io_uring backend ----
+// Completion-based: one multishot accept on the listen socket, one multishot
+// recv per client reading into a provided-buffer ring, and all replies of a
+// loop iteration queued as send SQEs that go out with the next wait, so a
+// round costs one io_uring_enter() instead of a syscall per read/send.
+// Needs Linux 6.0+ (multishot recv), init() fails otherwise
+struct UringBackend : EventBackend {
+    static const unsigned RING_ENTRIES = 1024;
+    static const unsigned BUF_COUNT = 512;     // provided recv buffers (power of 2)
+    static const unsigned BUF_SIZE = 2048;
+    static const unsigned short BUF_GROUP = 0;
+
+    // What a submission was for, packed into user_data with the fd and its
+    // generation (sends carry their Send id instead)
+    enum Op : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_CANCEL, OP_WAKEUP };
+
+    // A send the kernel may still be reading from
+    struct Send {
+        int socket;
+        uint32_t gen;           // wireGen() of the socket's generation
+        std::string buf;
+    };
+
+    // Per-socket state, indexed by fd. The generation changes when the
+    // socket is removed, so completions for a closed fd are never mistaken
+    // for a new connection that reused the number
+    struct Conn {
+        uint32_t gen = 0;
+        bool active = false;
+        bool sending = false;   // one send in flight per socket keeps bytes in order
+        bool reading = false;   // multishot recv armed (until its last completion)
+        bool pausing = false;   // reads paused for a handoff, the recv is not re-armed
+        bool closing = false;   // session closed, the socket closes after its sends
+        SessionId session = -1;
+        std::string unsent;     // a closed session's output queued behind the in-flight send
+    };
+
+    int ring_fd = -1;
+    int server_fd = -1;
+    int wakeup_fd = -1;
+
+    // Submission/completion ring views
+    void* ring_ptr = MAP_FAILED;
+    size_t ring_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries = 0;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned sq_local_tail = 0;
+    unsigned to_submit = 0;
+
+    // Provided buffers for multishot recv
+    io_uring_buf_ring* buf_ring = (io_uring_buf_ring*)MAP_FAILED;
+    size_t buf_ring_size = 0;
+    std::vector<char> buf_base;
+
+    std::vector<Conn> conns;
+    // Send slots, reused through a free list; a deque so a slot's buffer never
+    // moves while the kernel reads it. A finished slot keeps its buffer's
+    // capacity and trades it back to the next player it sends for
+    std::deque<Send> sends;
+    std::vector<uint32_t> free_sends;
+
+    // Live upgrade: nothing is re-armed once stopping, busy() until the
+    // accept and every recv have ended and all sends completed. Sends still
+    // stuck at the deadline (client not reading) are cancelled and their
+    // bytes go back into the player's output, which is handed over
+    static const int SEND_DRAIN_MS = 2000;
+    bool stopping = false;
+    bool sends_cancelled = false;
+    bool accept_armed = false;
+    int recvs_armed = 0;
+    std::chrono::steady_clock::time_point stop_deadline;
+
+    ~UringBackend() {
+        if (buf_ring != MAP_FAILED) munmap(buf_ring, buf_ring_size);
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if (ring_ptr != MAP_FAILED) munmap(ring_ptr, ring_size);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    const char* name() override { return "io_uring"; }
+
+    // Only 24 bits of the generation fit in user_data; every comparison
+    // against a completion goes through this
+    static uint32_t wireGen(uint32_t gen) { return gen & 0xffffff; }
+
+    static uint64_t makeData(Op op, uint32_t gen, int fd) {
+        return ((uint64_t)op << 56) | ((uint64_t)wireGen(gen) << 32) | (uint32_t)fd;
+    }
+
+    bool init(int listen_fd) override {
+        server_fd = listen_fd;
+
+        // Multishot recv arrived in 6.0, older kernels use epoll
+        utsname uts;
+        int major = 0, minor = 0;
+        if (uname(&uts) != 0 || sscanf(uts.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+            return false;
+        }
+
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (ring_fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_EXT_ARG)) {
+            return false;
+        }
+
+        // SQ and CQ rings share one mapping
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ring_size = std::max(sq_size, cq_size);
+        ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+        if (ring_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* base = (char*)ring_ptr;
+        sq_head = (unsigned*)(base + params.sq_off.head);
+        sq_tail = (unsigned*)(base + params.sq_off.tail);
+        sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(base + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = (unsigned*)(base + params.cq_off.head);
+        cq_tail = (unsigned*)(base + params.cq_off.tail);
+        cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+        sq_local_tail = *sq_tail;
+
+        // Registers the provided-buffer ring the kernel picks recv buffers from
+        buf_ring_size = BUF_COUNT * sizeof(io_uring_buf);
+        buf_ring = (io_uring_buf_ring*)mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED) {
+            return false;
+        }
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = BUF_COUNT;
+        reg.bgid = BUF_GROUP;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
+        buf_base.resize(BUF_COUNT * BUF_SIZE);
+        for (unsigned bid = 0; bid < BUF_COUNT; bid++) {
+            recycleBuffer(bid);
+        }
+
+        armAccept();
+        return enter(0) >= 0;
+    }
+
+    // Cancels the recv; the completions already on their way are still
+    // delivered, so the input buffer holds everything read from the socket
+    // once it is no longer reading
+    bool pauseReading(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket < 0 || socket >= (int)conns.size() || !conns[socket].active) {
+            return true;
+        }
+        Conn& c = conns[socket];
+        if (c.reading && !c.pausing) {
+            cancelRecv(socket);
+        }
+        c.pausing = true;
+        return !c.reading && !c.sending;
+    }
+
+    void resumeReading(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket < 0 || socket >= (int)conns.size() || !conns[socket].active || !conns[socket].pausing) {
+            return;
+        }
+        conns[socket].pausing = false;
+        if (!conns[socket].reading && !stopping) {
+            armRecv(socket);
+        }
+    }
+
+    // Handoffs pause the session first, so no recv or send is left and the
+    // queued output moves with the player
+    int detachSession(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket < 0 || socket >= (int)conns.size() || !conns[socket].active) {
+            return socket;
+        }
+        Conn& c = conns[socket];
+        if (c.reading) {
+            cancelRecv(socket);
+            enter(0); // submits now, while the fd number still belongs to this socket
+        }
+        c.active = false;
+        c.pausing = false;
+        c.session = -1;
+        c.gen++;
+        return socket;
+    }
+
+    // Last replies (e.g. "Goodbye!") still go out, after the send in flight
+    // if there is one. The socket stays open (so its fd number can't be
+    // reused) until its last send completes
+    void closeSession(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket < 0 || socket >= (int)conns.size() || !conns[socket].active) {
+            if (socket >= 0) {
+                close(socket);
+            }
+            return;
+        }
+        Conn& c = conns[socket];
+        Player* player = findPlayer(session);
+        if (player != nullptr && player->pendingOutput() > 0 && !sends_cancelled) {
+            if (c.sending) {
+                c.unsent.append(player->output, player->output_sent, std::string::npos);
+                addMetric(shard_metrics->output_bytes, -(int64_t)player->pendingOutput());
+                player->output.clear();
+                player->output_sent = 0;
+            } else {
+                submitSend(socket, player);
+            }
+        }
+        if (c.reading) {
+            cancelRecv(socket);
+        }
+        c.active = false;
+        c.pausing = false;
+        c.session = -1;
+        if (c.sending) {
+            c.closing = true;
+        } else {
+            c.gen++;
+            close(socket);
+        }
+    }
+
+    void adoptClient(SessionId session) override {
+        int socket = sessionHandle(session);
+        if (socket >= (int)conns.size()) {
+            conns.resize(socket + 1);
+        }
+        conns[socket].active = true;
+        conns[socket].reading = false;
+        conns[socket].session = session;
+        if (!stopping) {
+            armRecv(socket);
+        }
+    }
+
+    void watchWakeup(int event_fd) override {
+        wakeup_fd = event_fd;
+        armWakeup();
+    }
+
+    // Write readiness is the kernel's job here: the iteration's output is
+    // handed over as one send SQE, submitted with the next wait. While a send
+    // is in flight the output keeps queuing and goes out when it completes
+    void flush(Player* player) override {
+        int socket = sessionHandle(player->session);
+        if (socket < 0 || socket >= (int)conns.size() || !conns[socket].active ||
+            conns[socket].sending || player->pendingOutput() == 0 || sends_cancelled) {
+            return;
+        }
+        submitSend(socket, player);
+    }
+
+    void runOnce(int timeout_ms) override {
+        // Submits everything queued since the last wait and blocks for a completion
+        int ret;
+        {
+            PROFILE_SCOPE(PROFILE_WAIT);
+            ret = enter(1, timeout_ms);
+        }
+        loop_now = std::chrono::steady_clock::now();
+        if (ret < 0 && errno != EINTR && errno != EBUSY && errno != ETIME) {
+            LOG(ERROR) << "io_uring_enter error";
+            return;
+        }
+
+        // Drains the completion queue (head advances before each handler so
+        // handlers can queue new submissions freely)
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            handleCompletion(cqe);
+        }
+    }
+
+    // Cancels the multishot accept and recvs; completions still on their
+    // way are dispatched as usual until busy() turns false
+    void stopReading() override {
+        stopping = true;
+        stop_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SEND_DRAIN_MS);
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = makeData(OP_ACCEPT, 0, server_fd);
+        sqe->user_data = makeData(OP_CANCEL, 0, server_fd);
+        for (int socket = 0; socket < (int)conns.size(); socket++) {
+            if (conns[socket].active && conns[socket].reading) {
+                cancelRecv(socket);
+            }
+        }
+        enter(0);
+    }
+
+    bool busy() override {
+        bool sending = sends.size() > free_sends.size();
+        if (sending && !sends_cancelled && std::chrono::steady_clock::now() >= stop_deadline) {
+            sends_cancelled = true;
+            std::vector<bool> idle(sends.size(), false);
+            for (uint32_t id : free_sends) {
+                idle[id] = true;
+            }
+            for (uint32_t id = 0; id < sends.size(); id++) {
+                if (!idle[id]) {
+                    io_uring_sqe* sqe = getSqe();
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = ((uint64_t)OP_SEND << 56) | id;
+                    sqe->user_data = makeData(OP_CANCEL, 0, sends[id].socket);
+                }
+            }
+            enter(0);
+        }
+        return accept_armed || recvs_armed > 0 || sending;
+    }
+
+    // ---- Ring helpers ----
+
+    int enter(unsigned wait_nr, int timeout_ms = -1) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        if (wait_nr == 0 || timeout_ms < 0) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, NULL, 0);
+            if (ret > 0) {
+                to_submit -= ret;
+            }
+            return ret;
+        }
+
+        // Bounded wait, the timeout is passed through the extended argument
+        __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)&ts;
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                          flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret > 0) {
+            to_submit -= ret;
+        }
+        return ret;
+    }
+
+    io_uring_sqe* getSqe() {
+        // Ring full -> submits what is queued to make room
+        while (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            enter(0);
+        }
+        unsigned index = sq_local_tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        to_submit++;
+        return sqe;
+    }
+
+    void recycleBuffer(unsigned short bid) {
+        // Indexes the entries by hand: in C++ the header's flexible 'bufs'
+        // array does not start at offset 0 like the kernel expects
+        unsigned short tail = buf_ring->tail;
+        io_uring_buf* buf = (io_uring_buf*)buf_ring + (tail & (BUF_COUNT - 1));
+        buf->addr = (uint64_t)&buf_base[bid * BUF_SIZE];
+        buf->len = BUF_SIZE;
+        buf->bid = bid;
+        __atomic_store_n(&buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    void armAccept() {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = server_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        sqe->user_data = makeData(OP_ACCEPT, 0, server_fd);
+        accept_armed = true;
+    }
+
+    void armWakeup() {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakeup_fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = makeData(OP_WAKEUP, 0, wakeup_fd);
+    }
+
+    void armRecv(int socket) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        sqe->user_data = makeData(OP_RECV, conns[socket].gen, socket);
+        conns[socket].reading = true;
+        recvs_armed++;
+    }
+
+    // The recv's last completion comes back with IORING_CQE_F_MORE cleared
+    void cancelRecv(int socket) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = makeData(OP_RECV, conns[socket].gen, socket);
+        sqe->user_data = makeData(OP_CANCEL, 0, socket);
+    }
+
+    void prepSend(uint32_t id, const Send& send) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = send.socket;
+        sqe->addr = (uint64_t)send.buf.data();
+        sqe->len = send.buf.length();
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = ((uint64_t)OP_SEND << 56) | id;
+    }
+
+    // Moves a player's queued output into one send SQE
+    // (Profiled as "send", though the kernel does the actual send during the wait)
+    void submitSend(int socket, Player* player) {
+        PROFILE_SCOPE(PROFILE_SEND);
+        addMetric(shard_metrics->output_bytes, -(int64_t)player->output.size());
+        startSend(socket, player->output); // player gets the slot's old (empty) buffer
+        player->output_sent = 0;
+    }
+
+    void startSend(int socket, std::string& output) {
+        Conn& c = conns[socket];
+        uint32_t id;
+        if (free_sends.empty()) {
+            id = sends.size();
+            sends.emplace_back();
+        } else {
+            id = free_sends.back();
+            free_sends.pop_back();
+        }
+        Send& send = sends[id];
+        send.socket = socket;
+        send.gen = wireGen(c.gen);
+        send.buf.clear();
+        send.buf.swap(output);
+        c.sending = true;
+        prepSend(id, send);
+    }
+
+    // A closed session's send completed: what queued up behind it goes
+    // next, then the socket is closed
+    void continueClosing(int socket, int res) {
+        Conn& c = conns[socket];
+        c.sending = false;
+        if (res >= 0 && !c.unsent.empty() && !sends_cancelled) {
+            startSend(socket, c.unsent);
+            return;
+        }
+        c.unsent.clear();
+        c.closing = false;
+        c.gen++;
+        close(socket);
+    }
+
+
+    bool isCurrent(int socket, uint32_t gen) {
+        return socket >= 0 && socket < (int)conns.size() && conns[socket].active &&
+               wireGen(conns[socket].gen) == gen;
+    }
+
+    void handleCompletion(const io_uring_cqe& cqe) {
+        Op op = (Op)(cqe.user_data >> 56);
+        uint32_t gen = wireGen(cqe.user_data >> 32);
+        int socket = (int)(uint32_t)cqe.user_data;
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        switch (op) {
+            case OP_ACCEPT: {
+                if (cqe.res >= 0) {
+                    int opt = 1;
+                    setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                    adoptClient(onClientConnected(cqe.res));
+                } else if (!(stopping && cqe.res == -ECANCELED)) {
+                    LOG(ERROR) << "Accept failed!";
+                }
+                if (!more) {
+                    accept_armed = false;
+                    if (!stopping) {
+                        armAccept(); // multishot accept ended, re-arms it
+                    }
+                }
+                break;
+            }
+            case OP_RECV: {
+                bool current = isCurrent(socket, gen);
+                if (current) {
+                    if (cqe.res > 0) {
+                        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                        handleClientMessage(conns[socket].session, &buf_base[bid * BUF_SIZE], cqe.res);
+                    } else if (cqe.res != -ENOBUFS &&
+                               !((stopping || conns[socket].pausing) && cqe.res == -ECANCELED)) {
+                        // 0 = disconnection, < 0 means error
+                        onClientClosed(conns[socket].session);
+                    }
+                }
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                // Multishot recv stops on errors/buffer exhaustion, re-arms if
+                // still connected and not paused
+                if (!more) {
+                    recvs_armed--;
+                    if (socket < (int)conns.size() && wireGen(conns[socket].gen) == gen) {
+                        conns[socket].reading = false;
+                    }
+                    if (!stopping && isCurrent(socket, gen) && !conns[socket].pausing) {
+                        armRecv(socket);
+                    }
+                }
+                break;
+            }
+            case OP_SEND: {
+                uint32_t id = (uint32_t)cqe.user_data;
+                Send& send = sends[id];
+                socket = send.socket;
+                bool current = isCurrent(socket, send.gen);
+                bool closing = !current && conns[socket].closing && wireGen(conns[socket].gen) == send.gen;
+
+                // Partial send -> sends the rest from the same buffer
+                if ((current || closing) && cqe.res > 0 && cqe.res < (int)send.buf.length()) {
+                    send.buf.erase(0, cqe.res);
+                    prepSend(id, send);
+                    break;
+                }
+                free_sends.push_back(id);
+                if (closing) {
+                    continueClosing(socket, cqe.res);
+                    break;
+                }
+                if (current) {
+                    conns[socket].sending = false;
+                    SessionId session = conns[socket].session;
+                    Player* player = findPlayer(session);
+                    if (sends_cancelled && cqe.res == -ECANCELED && player != nullptr) {
+                        // Nothing of it was sent, goes out from the new process instead
+                        player->output.insert(player->output_sent, send.buf);
+                        addMetric(shard_metrics->output_bytes, send.buf.size());
+                    } else if (cqe.res < 0) {
+                        onSendFailed(session);
+                    } else if (player != nullptr && player->pendingOutput() > 0) {
+                        queueFlush(player); // sends whatever queued up meanwhile
+                    }
+                }
+                break;
+            }
+            case OP_WAKEUP:
+                onShardWakeup();
+                if (!more) {
+                    armWakeup();
+                }
+                break;
+            case OP_CANCEL:
+                break;
+        }
+    }
+};
+
+// ------------------- Admin Endpoint -------------------
+// --admin-port N serves metrics over HTTP on 127.0.0.1:N from its own
+// thread, so scrapes never take time from the game loops:
+//   GET /metrics       Prometheus text format
+//   GET /metrics.json  JSON, with rates since the previous scrape
+// Shard counters are summed when a request comes in; handler latency
+// quantiles are included when built with -DGAME_PROFILING
+
+const char* PLAYER_STATE_NAMES[5] = {"connected", "in_queue", "choosing", "waiting", "viewing_results"};
+const char* GAME_STATE_NAMES[4] = {"matchmaking", "round_active", "round_complete", "game_over"};
+const char* TIMER_KIND_NAMES[5] = {"none", "idle", "queue", "choice", "ready"};
+
+// All shards' counters added up
+struct MetricsSnapshot {
+    std::chrono::steady_clock::time_point taken;
+    int64_t players[5] = {};
+    int64_t games[4] = {};
+    int64_t output_bytes = 0;
+    int64_t connects = 0;
+    int64_t disconnects = 0;
+    int64_t rounds = 0;
+    int64_t matches = 0;
+    int64_t match_wait_ms_sum = 0;
+    int64_t match_wait_ms_max = 0;
+    int64_t match_rating_gap_sum = 0;
+    int64_t match_rating_gap_max = 0;
+    int64_t forfeits_disconnect = 0;
+    int64_t forfeits_timeout = 0;
+    int64_t timeouts[5] = {};
+};
+
+MetricsSnapshot collectMetrics() {
+    MetricsSnapshot snapshot;
+    snapshot.taken = std::chrono::steady_clock::now();
+    auto get = [](const std::atomic<int64_t>& metric) { return metric.load(std::memory_order_relaxed); };
+    for (Shard* shard : shards) {
+        const ShardMetrics& m = shard->metrics;
+        for (int i = 0; i < 5; i++) {
+            snapshot.players[i] += get(m.players[i]);
+            snapshot.timeouts[i] += get(m.timeouts[i]);
+        }
+        for (int i = 0; i < 4; i++) {
+            snapshot.games[i] += get(m.games[i]);
+        }
+        snapshot.output_bytes += get(m.output_bytes);
+        snapshot.connects += get(m.connects);
+        snapshot.disconnects += get(m.disconnects);
+        snapshot.rounds += get(m.rounds);
+        snapshot.matches += get(m.matches);
+        snapshot.match_wait_ms_sum += get(m.match_wait_ms_sum);
+        snapshot.match_wait_ms_max = std::max(snapshot.match_wait_ms_max, get(m.match_wait_ms_max));
+        snapshot.match_rating_gap_sum += get(m.match_rating_gap_sum);
+        snapshot.match_rating_gap_max = std::max(snapshot.match_rating_gap_max, get(m.match_rating_gap_max));
+        snapshot.forfeits_disconnect += get(m.forfeits_disconnect);
+        snapshot.forfeits_timeout += get(m.forfeits_timeout);
+    }
+    return snapshot;
+}
+
+// One Prometheus sample line
+void appendSample(std::string& out, const char* name, const std::string& labels, int64_t value) {
+    out += name;
+    if (!labels.empty()) {
+        out += "{" + labels + "}";
+    }
+    out += " " + std::to_string(value) + "\n";
+}
+
+void appendHelp(std::string& out, const char* name, const char* type, const char* help) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+std::string formatPrometheus(const MetricsSnapshot& m) {
+    std::string out;
+    appendHelp(out, "rps_players", "gauge", "Connected players by state");
+    for (int i = 0; i < 5; i++) {
+        appendSample(out, "rps_players", std::string("state=\"") + PLAYER_STATE_NAMES[i] + "\"", m.players[i]);
+    }
+    appendHelp(out, "rps_queue_depth", "gauge", "Players waiting for a match");
+    appendSample(out, "rps_queue_depth", "", m.players[(int)PlayerState::IN_QUEUE]);
+    appendHelp(out, "rps_games", "gauge", "Active games by state");
+    for (int i = 0; i < 4; i++) {
+        appendSample(out, "rps_games", std::string("state=\"") + GAME_STATE_NAMES[i] + "\"", m.games[i]);
+    }
+    appendHelp(out, "rps_output_queued_bytes", "gauge", "Reply bytes queued but not yet handed to the kernel");
+    appendSample(out, "rps_output_queued_bytes", "", m.output_bytes);
+    appendHelp(out, "rps_connects_total", "counter", "Accepted connections");
+    appendSample(out, "rps_connects_total", "", m.connects);
+    appendHelp(out, "rps_disconnects_total", "counter", "Closed connections");
+    appendSample(out, "rps_disconnects_total", "", m.disconnects);
+    appendHelp(out, "rps_rounds_total", "counter", "Rounds resolved");
+    appendSample(out, "rps_rounds_total", "", m.rounds);
+    appendHelp(out, "rps_matches_total", "counter", "Matches started");
+    appendSample(out, "rps_matches_total", "", m.matches);
+    appendHelp(out, "rps_match_wait_ms_sum", "counter", "Queue wait of the longer-waiting player, summed over matches started");
+    appendSample(out, "rps_match_wait_ms_sum", "", m.match_wait_ms_sum);
+    appendHelp(out, "rps_match_wait_ms_max", "gauge", "Longest queue wait of a match started");
+    appendSample(out, "rps_match_wait_ms_max", "", m.match_wait_ms_max);
+    appendHelp(out, "rps_match_rating_gap_sum", "counter", "Rating gap between the two players, summed over matches started");
+    appendSample(out, "rps_match_rating_gap_sum", "", m.match_rating_gap_sum);
+    appendHelp(out, "rps_match_rating_gap_max", "gauge", "Largest rating gap of a match started");
+    appendSample(out, "rps_match_rating_gap_max", "", m.match_rating_gap_max);
+    appendHelp(out, "rps_forfeits_total", "counter", "Matches ended by a forfeit");
+    appendSample(out, "rps_forfeits_total", "reason=\"disconnect\"", m.forfeits_disconnect);
+    appendSample(out, "rps_forfeits_total", "reason=\"timeout\"", m.forfeits_timeout);
+    appendHelp(out, "rps_timeouts_total", "counter", "Expired player timeouts");
+    for (int i = 1; i < 5; i++) {
+        appendSample(out, "rps_timeouts_total", std::string("kind=\"") + TIMER_KIND_NAMES[i] + "\"", m.timeouts[i]);
+    }
+#ifdef GAME_PROFILING
+    appendHelp(out, "rps_latency_ns", "summary", "Handler latency in nanoseconds");
+    std::lock_guard<std::mutex> lock(shard_profiles_lock);
+    for (int point = 0; point < PROFILE_POINTS; point++) {
+        ProfileSummary summary = summarizeProfile(point);
+        std::string label = std::string("point=\"") + profile_point_names[point] + "\"";
+        if (summary.samples > 0) {
+            for (const char* q : {"0.5", "0.99", "0.999"}) {
+                appendSample(out, "rps_latency_ns", label + ",quantile=\"" + q + "\"", summary.percentile(atof(q)));
+            }
+        }
+        appendSample(out, "rps_latency_ns_sum", label, summary.total_ns);
+        appendSample(out, "rps_latency_ns_count", label, summary.samples);
+    }
+#endif
+    return out;
+}
+
+std::string formatJson(const MetricsSnapshot& m, const MetricsSnapshot& previous) {
+    double seconds = std::chrono::duration<double>(m.taken - previous.taken).count();
+    auto rate = [&](int64_t now, int64_t before) {
+        return std::to_string(seconds > 0 ? (now - before) / seconds : 0.0);
+    };
+    auto object = [](const char* const* names, const int64_t* values, int first, int count) {
+        std::string out = "{";
+        for (int i = first; i < count; i++) {
+            out += std::string(i > first ? ", " : "") + "\"" + names[i] + "\": " + std::to_string(values[i]);
+        }
+        return out + "}";
+    };
+    std::string out = "{\n";
+    out += "  \"players\": " + object(PLAYER_STATE_NAMES, m.players, 0, 5) + ",\n";
+    out += "  \"queue_depth\": " + std::to_string(m.players[(int)PlayerState::IN_QUEUE]) + ",\n";
+    out += "  \"games\": " + object(GAME_STATE_NAMES, m.games, 0, 4) + ",\n";
+    out += "  \"output_queued_bytes\": " + std::to_string(m.output_bytes) + ",\n";
+    out += "  \"totals\": {\"connects\": " + std::to_string(m.connects) +
+           ", \"disconnects\": " + std::to_string(m.disconnects) +
+           ", \"rounds\": " + std::to_string(m.rounds) +
+           ", \"matches\": " + std::to_string(m.matches) +
+           ", \"forfeits_disconnect\": " + std::to_string(m.forfeits_disconnect) +
+           ", \"forfeits_timeout\": " + std::to_string(m.forfeits_timeout) + "},\n";
+    out += "  \"timeouts\": " + object(TIMER_KIND_NAMES, m.timeouts, 1, 5) + ",\n";
+    out += "  \"matchmaking\": {\"wait_ms_sum\": " + std::to_string(m.match_wait_ms_sum) +
+           ", \"wait_ms_max\": " + std::to_string(m.match_wait_ms_max) +
+           ", \"rating_gap_sum\": " + std::to_string(m.match_rating_gap_sum) +
+           ", \"rating_gap_max\": " + std::to_string(m.match_rating_gap_max) + "},\n";
+    out += "  \"per_second\": {\"rounds\": " + rate(m.rounds, previous.rounds) +
+           ", \"matches\": " + rate(m.matches, previous.matches) +
+           ", \"disconnects\": " + rate(m.disconnects, previous.disconnects) +
+           ", \"forfeits\": " + rate(m.forfeits_disconnect + m.forfeits_timeout,
+                                     previous.forfeits_disconnect + previous.forfeits_timeout) +
+           ", \"interval_s\": " + std::to_string(seconds) + "}";
+#ifdef GAME_PROFILING
+    out += ",\n  \"latency_ns\": {";
+    std::lock_guard<std::mutex> lock(shard_profiles_lock);
+    for (int point = 0; point < PROFILE_POINTS; point++) {
+        ProfileSummary summary = summarizeProfile(point);
+        out += std::string(point > 0 ? ", " : "") + "\"" + profile_point_names[point] + "\": {\"count\": " +
+               std::to_string(summary.samples);
+        if (summary.samples > 0) {
+            out += ", \"p50\": " + std::to_string(summary.percentile(0.50)) +
+                   ", \"p99\": " + std::to_string(summary.percentile(0.99)) +
+                   ", \"p999\": " + std::to_string(summary.percentile(0.999)) +
+                   ", \"max\": " + std::to_string(summary.max_ns);
+        }
+        out += "}";
+    }
+    out += "}";
+#endif
+    return out + "\n}\n";
+}
+
+// Listening socket on 127.0.0.1 only, metrics are not for the players
+int createAdminSocket(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+        std::cerr << "Admin port " << port << " unavailable: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return fd;
+}
+
+// Local port a socket is bound to, -1 if unknown
+int socketPort(int fd) {
+    sockaddr_in address;
+    socklen_t len = sizeof(address);
+    if (getsockname(fd, (sockaddr*)&address, &len) < 0 || address.sin_family != AF_INET) {
+        return -1;
+    }
+    return ntohs(address.sin_port);
+}
+
+// Admin thread: one short HTTP/1.0 exchange per connection
+void adminLoop(int admin_fd) {
+    MetricsSnapshot previous = collectMetrics();
+    while (true) {
+        int client = accept(admin_fd, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        // A stuck client only holds the admin thread for a second
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                break;
+            }
+            request.append(buffer, n);
+        }
+
+        std::string status = "200 OK", type, body;
+        if (request.rfind("GET /metrics.json ", 0) == 0) {
+            MetricsSnapshot snapshot = collectMetrics();
+            body = formatJson(snapshot, previous);
+            previous = snapshot;
+            type = "application/json";
+        } else if (request.rfind("GET /metrics ", 0) == 0) {
+            body = formatPrometheus(collectMetrics());
+            type = "text/plain; version=0.0.4";
+        } else {
+            status = "404 Not Found";
+            type = "text/plain";
+            body = "Try /metrics or /metrics.json\n";
+        }
+        std::string response = "HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        writeAll(client, response.data(), response.size());
+        close(client);
+    }
+}
+
+// ------------------- Live Upgrade -------------------
+// --upgrade-socket PATH: a new server binary started with the same PATH
+// connects to the running one and takes over without dropping anyone. The
+// old process stops reading, lets its in-flight I/O finish, writes out
+// every shard (players, games, timers, unsent output) and sends that plus
+// all its sockets over PATH (SCM_RIGHTS), then exits. Clients stay
+// connected and only see a short pause.
+//
+// Handoff: [u64 length][blob], then the fds, UPGRADE_FDS_PER_MSG per
+// 1-byte message. The blob refers to sockets by their old fd numbers and
+// lists them in the order they are sent. Structs are copied as they are,
+// so UPGRADE_VERSION changes with PlayerStats or the layout below
+
+const char UPGRADE_MAGIC[8] = {'R', 'P', 'S', 'U', 'P', 'G', 'R', '1'};
+const uint32_t UPGRADE_VERSION = 1;
+const int UPGRADE_FDS_PER_MSG = 200;    // kernel limit is 253 per message
+const int UPGRADE_DEADLINE_MS = 5000;   // for a shard's in-flight I/O to settle
+
+// Old process
+std::atomic<int> upgrade_quiet(0);          // shards that stopped all I/O
+std::atomic<int> upgrade_done(0);           // shards written out
+std::mutex upgrade_lock;                    // guards the two below
+std::vector<std::string> upgrade_shards;    // written shards, by shard id
+std::vector<int> upgrade_fds;               // their sockets, listen sockets included
+int admin_listen_fd = -1;                   // handed over too (--admin-port)
+thread_local bool upgrade_stopped = false;
+thread_local std::chrono::steady_clock::time_point upgrade_deadline;
+
+// New process: what the old one handed over
+std::vector<std::string> takeover_shards;       // one blob per old shard
+std::vector<int> takeover_listen_fds;           // by old shard
+std::unordered_map<int, int> takeover_fds;      // old fd number -> received fd
+int takeover_admin_fd = -1;
+
+struct HandoffWriter {
+    std::string out;
+
+    template <typename T>
+    void put(const T& value) {
+        out.append((const char*)&value, sizeof(value));
+    }
+    void putString(std::string_view value) {
+        put((uint32_t)value.size());
+        out.append(value.data(), value.size());
+    }
+};
+
+// Bounds-checked reads, ok turns false on the first one past the end
+struct HandoffReader {
+    const char* pos;
+    const char* end;
+    bool ok = true;
+
+    explicit HandoffReader(const std::string& data) : pos(data.data()), end(data.data() + data.size()) {}
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (!ok || (size_t)(end - pos) < sizeof(T)) {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    std::string getString() {
+        uint32_t len = get<uint32_t>();
+        if (!ok || (size_t)(end - pos) < len) {
+            ok = false;
+            return "";
+        }
+        std::string value(pos, len);
+        pos += len;
+        return value;
+    }
+};
+
+sockaddr_un upgradeAddress(const std::string& path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+// ---- Old process ----
+
+void writePlayer(HandoffWriter& w, const Player* player, int socket, bool queued,
+                 std::chrono::steady_clock::time_point now) {
+    w.put((int32_t)socket);
+    w.putString(player->name);
+    w.put((uint8_t)player->state);
+    w.put((uint8_t)player->protocol);
+    w.put(player->stats);
+    w.put((uint8_t)queued);
+    w.put((int64_t)(queued ? std::chrono::duration_cast<std::chrono::milliseconds>(now - player->queued_at).count() : 0));
+    int64_t timer_ms = 0;
+    if (player->timer_kind != TimerKind::NONE) {
+        timer_ms = std::max<int64_t>(0, (int64_t)player->timer_expires - (int64_t)currentTick()) * TIMER_TICK_MS;
+    }
+    w.put((uint8_t)player->timer_kind);
+    w.put(timer_ms);
+    w.putString(std::string_view(player->input, player->input_len));
+    w.put((uint8_t)player->input_overflow);
+    w.putString(std::string_view(player->output).substr(player->output_sent));
+}
+
+// This shard's listen socket, players (inbox included) and games;
+// their sockets are added to fds
+std::string serializeShard(std::vector<int>& fds) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<Player*> players;
+    for (ConnectionSlot& slot : connections) {
+        if (slot.player != nullptr && !slot.player->closing) {
+            players.push_back(slot.player);
+        }
+    }
+    std::vector<HandedPlayer> arrived; // handed over by another shard, not adopted yet
+    {
+        std::lock_guard<std::mutex> lock(current_shard->inbox_lock);
+        arrived.swap(current_shard->inbox);
+    }
+
+    HandoffWriter w;
+    w.put((int32_t)current_shard->listen_fd);
+    fds.push_back(current_shard->listen_fd);
+
+    std::unordered_map<const Player*, uint32_t> index;
+    w.put((uint32_t)(players.size() + arrived.size()));
+    for (Player* player : players) {
+        uint32_t position = index.size();
+        index[player] = position;
+        int socket = sessionHandle(player->session);
+        writePlayer(w, player, socket, player->in_queue || player->resume_match != 0, now);
+        fds.push_back(socket);
+    }
+    for (const HandedPlayer& handed : arrived) {
+        writePlayer(w, &handed.player, handed.handle, true, now);
+        fds.push_back(handed.handle);
+    }
+
+    std::vector<const Game*> games;
+    for (Player* player : players) {
+        if (player->game != nullptr && player->game->player1 == player) {
+            games.push_back(player->game);
+        }
+    }
+    w.put((uint32_t)games.size());
+    for (const Game* game : games) {
+        w.put(index[game->player1]);
+        w.put(index[game->player2]);
+        w.put((uint8_t)game->choice1);
+        w.put((uint8_t)game->choice2);
+        w.put((int32_t)game->score1);
+        w.put((int32_t)game->score2);
+        w.put((uint8_t)game->state);
+        w.put(game->match_id);
+        w.put((int32_t)game->round);
+    }
+    return w.out;
+}
+
+// Last stage of the loop. Once an upgrade is requested: stops reading,
+// lets the backend's in-flight I/O settle, waits until every shard got
+// that far (so no player moves between shards any more) and writes this
+// shard out. True when the shard is handed over and its loop ends
+bool upgradeStep() {
+    if (!upgrade_requested.load(std::memory_order_acquire)) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!upgrade_stopped) {
+        upgrade_stopped = true;
+        upgrade_deadline = now + std::chrono::milliseconds(UPGRADE_DEADLINE_MS);
+        backend->stopReading();
+    }
+    if (backend->busy()) {
+        if (now < upgrade_deadline) {
+            return false;
+        }
+        LOG(WARNING) << "Shard " << current_shard->id << " still has I/O in flight, handing over anyway";
+    }
+
+    upgrade_quiet.fetch_add(1);
+    while (upgrade_quiet.load() < (int)shards.size()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::vector<int> fds;
+    std::string blob = serializeShard(fds);
+    {
+        std::lock_guard<std::mutex> lock(upgrade_lock);
+        upgrade_shards[current_shard->id] = std::move(blob);
+        upgrade_fds.insert(upgrade_fds.end(), fds.begin(), fds.end());
+    }
+    LOG(INFO) << "Shard " << current_shard->id << " handed over " << (fds.size() - 1) << " connection(s)";
+    upgrade_done.fetch_add(1);
+    return true;
+}
+
+// send() of the whole buffer (no SIGPIPE if the new process died)
+bool sendAll(int socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(socket, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool sendFds(int socket, const std::vector<int>& fds) {
+    for (size_t first = 0; first < fds.size(); first += UPGRADE_FDS_PER_MSG) {
+        size_t count = std::min<size_t>(UPGRADE_FDS_PER_MSG, fds.size() - first);
+        char byte = 0;
+        iovec iov = {&byte, 1};
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fds[first], count * sizeof(int));
+        if (sendmsg(socket, &msg, MSG_NOSIGNAL) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Upgrade thread: waits for the new process, stops the shards and hands
+// everything over. Returns when done, main then exits
+void upgradeListenerLoop(int listen_fd) {
+    static const int ACCEPT_RETRY_MS = 1000;
+    int client;
+    while ((client = accept(listen_fd, NULL, NULL)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        // Out of fds or similar: backs off instead of spinning, an upgrade
+        // can still be attempted once it clears
+        LOG(ERROR) << "Live upgrade: accept failed (" << (const char*)strerror(errno) << "), retrying";
+        std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+    }
+    LOG(INFO) << "Live upgrade: new process connected, handing over";
+    upgrade_shards.resize(shards.size());
+    upgrade_requested.store(true, std::memory_order_release);
+    for (Shard* shard : shards) {
+        uint64_t one = 1;
+        if (write(shard->wakeup_fd, &one, sizeof(one)) < 0) {
+            LOG(ERROR) << "Shard wakeup failed!";
+        }
+    }
+    while (upgrade_done.load() < (int)shards.size()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Interrupted matches still waiting are not carried over (their
+    // players, if back, are handed over as queued)
+    endInterruptedMatches(true);
+
+    // On disk before the new process opens the files
+    if (history_fd >= 0) {
+        drainHistory();
+    }
+    if (stats_enabled) {
+        drainStats();
+    }
+
+    std::vector<int> fds = upgrade_fds;
+    if (admin_listen_fd >= 0) {
+        fds.push_back(admin_listen_fd);
+    }
+    HandoffWriter w;
+    w.out.append(UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC));
+    w.put(UPGRADE_VERSION);
+    w.put((uint32_t)fds.size());
+    for (int fd : fds) {
+        w.put((int32_t)fd);
+    }
+    w.put((int32_t)admin_listen_fd);
+    {
+        std::lock_guard<std::mutex> lock(stats_lock);
+        w.put((uint32_t)player_stats.size());
+        for (const auto& entry : player_stats) {
+            w.putString(entry.first);
+            w.put(entry.second);
+        }
+    }
+    w.put((uint32_t)upgrade_shards.size());
+    for (const std::string& blob : upgrade_shards) {
+        w.putString(blob);
+    }
+
+    uint64_t length = w.out.size();
+    if (sendAll(client, (const char*)&length, sizeof(length)) && sendAll(client, w.out.data(), w.out.size()) &&
+        sendFds(client, fds)) {
+        LOG(INFO) << "Live upgrade: handed over " << fds.size() << " socket(s), exiting";
+    } else {
+        LOG(ERROR) << "Live upgrade: handoff failed (" << (const char*)strerror(errno) << "), exiting";
+    }
+    close(client);
+    close(listen_fd);
+}
+
+// Listens on PATH for the next upgrade (replacing a stale or the old
+// process's socket file), -1 on failure
+int createUpgradeSocket(const std::string& path) {
+    sockaddr_un address = upgradeAddress(path);
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+        std::cerr << "Upgrade socket " << path << " unavailable: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return fd;
+}
+
+// ---- New process ----
+
+bool readAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool receiveFds(int socket, size_t count, std::vector<int>& fds) {
+    while (fds.size() < count) {
+        char byte;
+        iovec iov = {&byte, 1};
+        std::vector<char> control(CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        if (recvmsg(socket, &msg, 0) != 1 || (msg.msg_flags & MSG_CTRUNC)) {
+            return false;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const char* data = (const char*)CMSG_DATA(cmsg);
+                for (size_t i = 0; i < n; i++) {
+                    int fd;
+                    memcpy(&fd, data + i * sizeof(int), sizeof(int));
+                    fds.push_back(fd);
+                }
+            }
+        }
+    }
+    return fds.size() == count;
+}
+
+// Connects to PATH and receives a running server's state: 1 when taken
+// over, 0 when no server listens there (fresh start), -1 on failure
+int receiveTakeover(const std::string& path) {
+    sockaddr_un address = upgradeAddress(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    std::cout << "Taking over from the server on " << path << "..." << std::endl;
+
+    uint64_t length = 0;
+    std::string blob;
+    if (readAll(fd, (char*)&length, sizeof(length))) {
+        blob.resize(length);
+        if (!readAll(fd, &blob[0], length)) {
+            blob.clear();
+        }
+    }
+    HandoffReader r(blob);
+    char magic[sizeof(UPGRADE_MAGIC)];
+    for (char& c : magic) {
+        c = r.get<char>();
+    }
+    if (!r.ok || memcmp(magic, UPGRADE_MAGIC, sizeof(magic)) != 0 || r.get<uint32_t>() != UPGRADE_VERSION) {
+        std::cerr << "Live upgrade failed: no handoff from the running server, or a different version" << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    std::vector<int> old_fds(r.get<uint32_t>());
+    for (int& old_fd : old_fds) {
+        old_fd = r.get<int32_t>();
+    }
+    int old_admin_fd = r.get<int32_t>();
+    uint32_t stats_count = r.get<uint32_t>();
+    for (uint32_t i = 0; i < stats_count && r.ok; i++) {
+        std::string name = r.getString();
+        player_stats[name] = r.get<PlayerStats>();
+    }
+    takeover_shards.resize(r.get<uint32_t>());
+    for (std::string& shard_blob : takeover_shards) {
+        shard_blob = r.getString();
+    }
+
+    std::vector<int> fds;
+    if (!r.ok || !receiveFds(fd, old_fds.size(), fds)) {
+        std::cerr << "Live upgrade failed: handoff cut short" << std::endl;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    for (size_t i = 0; i < fds.size(); i++) {
+        takeover_fds[old_fds[i]] = fds[i];
+    }
+    if (old_admin_fd >= 0) {
+        takeover_admin_fd = takeover_fds[old_admin_fd];
+    }
+    for (const std::string& shard_blob : takeover_shards) {
+        HandoffReader shard_reader(shard_blob);
+        takeover_listen_fds.push_back(takeover_fds[shard_reader.get<int32_t>()]);
+    }
+    return 1;
+}
+
+// Rebuilds one old shard's players and games in the current shard
+void restoreShard(const std::string& blob) {
+    auto now = std::chrono::steady_clock::now();
+    HandoffReader r(blob);
+    r.get<int32_t>(); // listen socket, taken over in main
+
+    std::vector<Player*> restored;
+    uint32_t player_count = r.get<uint32_t>();
+    for (uint32_t i = 0; i < player_count && r.ok; i++) {
+        int old_fd = r.get<int32_t>();
+        std::string name = r.getString();
+        PlayerState state = (PlayerState)r.get<uint8_t>();
+        Protocol protocol = (Protocol)r.get<uint8_t>();
+        PlayerStats stats = r.get<PlayerStats>();
+        bool queued = r.get<uint8_t>();
+        int64_t waited_ms = r.get<int64_t>();
+        TimerKind timer_kind = (TimerKind)r.get<uint8_t>();
+        int64_t timer_ms = r.get<int64_t>();
+        std::string input = r.getString();
+        bool input_overflow = r.get<uint8_t>();
+        std::string output = r.getString();
+        auto fd = takeover_fds.find(old_fd);
+        if (!r.ok || fd == takeover_fds.end()) {
+            r.ok = false;
+            break;
+        }
+
+        Player* player = player_pool.create(openSession(fd->second), name);
+        player->state = state;
+        player->protocol = protocol;
+        player->stats = stats;
+        player->input_len = std::min<int>(input.size(), Player::INPUT_BUFFER_SIZE);
+        memcpy(player->input, input.data(), player->input_len);
+        player->input_overflow = input_overflow;
+        player->output = std::move(output);
+
+        addPlayer(player);
+        backend->adoptClient(player->session);
+        addMetric(shard_metrics->players[(int)player->state]);
+        addMetric(shard_metrics->output_bytes, player->pendingOutput());
+        if (history_fd >= 0 && !player->name.empty()) {
+            player->name_id = internName(player->name);
+        }
+        if (queued) {
+            player->queued_at = now - std::chrono::milliseconds(waited_ms);
+            matchmaking_queue.push(player);
+            matchmaking_pending = true;
+        }
+        if (timer_kind != TimerKind::NONE) {
+            timing_wheel.arm(player, timer_kind, currentTick() + timer_ms / TIMER_TICK_MS);
+        }
+        if (player->pendingOutput() > 0) {
+            queueFlush(player);
+        }
+        restored.push_back(player);
+    }
+
+    uint32_t game_count = r.get<uint32_t>();
+    for (uint32_t i = 0; i < game_count && r.ok; i++) {
+        uint32_t p1 = r.get<uint32_t>();
+        uint32_t p2 = r.get<uint32_t>();
+        if (p1 >= restored.size() || p2 >= restored.size()) {
+            r.ok = false;
+            break;
+        }
+        Game* game = game_pool.create(restored[p1], restored[p2]);
+        game->choice1 = (Choice)r.get<uint8_t>();
+        game->choice2 = (Choice)r.get<uint8_t>();
+        game->score1 = r.get<int32_t>();
+        game->score2 = r.get<int32_t>();
+        game->state = (GameState)r.get<uint8_t>();
+        game->match_id = r.get<uint64_t>();
+        game->round = r.get<int32_t>();
+        restored[p1]->game = game;
+        restored[p2]->game = game;
+        addMetric(shard_metrics->games[(int)game->state]);
+        markSnapshotDirty(game);
+    }
+    if (!r.ok) {
+        LOG(ERROR) << "Handed-over shard state is corrupt, restored what was readable";
+    }
+    LOG(INFO) << "Shard " << current_shard->id << " took over " << restored.size() << " connection(s) and "
+              << game_count << " game(s)";
+}
+
+// Old shard i goes to new shard i % threads
+void restoreShards() {
+    for (size_t i = current_shard->id; i < takeover_shards.size(); i += shards.size()) {
+        restoreShard(takeover_shards[i]);
+    }
+}
+
+// ------------------- Snapshots -------------------
+// --snapshot FILE keeps a checkpoint of every shard's matches in progress,
+// so a crash does not lose them. A shard only lists the games that changed
+// (started, played a round, ended) and, at most once per
+// --snapshot-interval-ms, hands one small record per listed game to a
+// writer thread. The writer keeps the whole picture, encodes it and
+// replaces FILE (see replaceFile), so the loop neither encodes unchanged
+// games nor waits on the disk. Each hand-over notes how many history
+// records existed: on restart the history after the oldest of those
+// points (rounds and match ends the snapshot missed) brings the matches
+// up to date.
+//
+// The matches cut off by the crash then wait, by player name, for both
+// players to log in again and carry on from their score and round (see
+// rejoinInterruptedMatch). Those nobody came back for within
+// --queue-timeout are recorded as interrupted (HIST_INTERRUPTED, no winner).
+//
+// File: HistoryHeader (SNAPSHOT_MAGIC), u64 time written (us), u64 next
+// match id, u64 history records covered, u32 matches, [u64 match id,
+// name 1, name 2, u8 score 1, u8 score 2, u16 round]..., u32 queued
+// players, with names as [u32 length][bytes]
+
+const char SNAPSHOT_MAGIC[8] = {'R', 'P', 'S', 'S', 'N', 'A', 'P', '2'};
+
+std::string snapshot_path;                      // empty = snapshots off
+int snapshot_interval_ms = 1000;
+
+// A changed game as handed to the writer. The names only go along the
+// first time, in the batch's names
+struct SnapshotChange {
+    uint64_t match_id;
+    uint32_t name1_len;     // when named
+    uint32_t name2_len;
+    uint16_t round;
+    uint8_t score1;
+    uint8_t score2;
+    bool named;
+    bool ended;             // match over, the writer drops it
+};
+
+// One shard's changes since the writer last took them
+struct SnapshotBatch {
+    std::vector<SnapshotChange> changes;
+    std::string names;              // name 1 and 2 of every named change, in order
+    uint64_t history_records = 0;   // history_record_count when handed over
+    uint32_t queued = 0;
+    bool updated = false;           // not taken by the writer yet
+};
+
+std::vector<SnapshotBatch> snapshot_batches;    // by shard id
+std::mutex snapshot_lock;                       // guards snapshot_batches
+
+thread_local std::vector<Game*> snapshot_dirty_games;   // changed since the last hand-over (Game::snapshot_slot)
+thread_local SnapshotBatch snapshot_local;              // this shard's next hand-over
+thread_local uint32_t snapshot_queued = 0;              // queue length at the last hand-over
+thread_local std::chrono::steady_clock::time_point next_snapshot;
+
+// Flags the shard as holding changes the writer has not seen. Always done
+// before the history records of the change are counted
+void markShardUnsnapshotted() {
+    if (current_shard->snapshot_clean.load(std::memory_order_relaxed)) {
+        current_shard->snapshot_clean = false;
+    }
+}
+
+void markSnapshotDirty(Game* game) {
+    if (snapshot_path.empty() || game->snapshot_slot >= 0) {
+        return;
+    }
+    markShardUnsnapshotted();
+    game->snapshot_slot = (int)snapshot_dirty_games.size();
+    snapshot_dirty_games.push_back(game);
+}
+
+void addSnapshotChange(Game* game, bool ended) {
+    SnapshotChange change;
+    change.match_id = game->match_id;
+    change.name1_len = 0;
+    change.name2_len = 0;
+    change.round = (uint16_t)game->round;
+    change.score1 = (uint8_t)game->score1;
+    change.score2 = (uint8_t)game->score2;
+    change.named = !game->snapshot_known;
+    change.ended = ended;
+    if (change.named) {
+        change.name1_len = game->player1->name.size();
+        change.name2_len = game->player2->name.size();
+        snapshot_local.names += game->player1->name;
+        snapshot_local.names += game->player2->name;
+        game->snapshot_known = true;
+    }
+    snapshot_local.changes.push_back(change);
+}
+
+// Before a game is freed: off the dirty list, and the writer drops it if
+// it ever got it
+void snapshotGameEnded(Game* game) {
+    if (snapshot_path.empty()) {
+        return;
+    }
+    if (game->snapshot_slot >= 0) {
+        Game* last = snapshot_dirty_games.back();
+        snapshot_dirty_games[game->snapshot_slot] = last;
+        last->snapshot_slot = game->snapshot_slot;
+        snapshot_dirty_games.pop_back();
+        game->snapshot_slot = -1;
+    }
+    if (game->snapshot_known) {
+        markShardUnsnapshotted();
+        addSnapshotChange(game, true);
+    }
+}
+
+bool snapshotChanged() {
+    return !snapshot_dirty_games.empty() || !snapshot_local.changes.empty() ||
+           matchmaking_queue.size() != snapshot_queued;
+}
+
+// Snapshot stage of the loop (after submitHistory, so every record of the
+// state being handed over is already counted)
+void snapshotStep() {
+    if (snapshot_path.empty() || !snapshotChanged()) {
+        return;
+    }
+    if (loop_now < next_snapshot) {
+        return;
+    }
+    next_snapshot = loop_now + std::chrono::milliseconds(snapshot_interval_ms);
+    for (Game* game : snapshot_dirty_games) {
+        addSnapshotChange(game, false);
+        game->snapshot_slot = -1;
+    }
+    snapshot_dirty_games.clear();
+    snapshot_queued = (uint32_t)matchmaking_queue.size();
+
+    std::lock_guard<std::mutex> lock(snapshot_lock);
+    SnapshotBatch& shared = snapshot_batches[current_shard->id];
+    if (shared.changes.empty()) {
+        // Trades buffers, so both keep their capacity
+        shared.changes.swap(snapshot_local.changes);
+        shared.names.swap(snapshot_local.names);
+    } else {
+        // The writer has not taken the last one yet
+        shared.changes.insert(shared.changes.end(), snapshot_local.changes.begin(), snapshot_local.changes.end());
+        shared.names += snapshot_local.names;
+    }
+    snapshot_local.changes.clear();
+    snapshot_local.names.clear();
+    shared.history_records = history_record_count.load();
+    shared.queued = snapshot_queued;
+    shared.updated = true;
+    current_shard->snapshot_clean = true;
+}
+
+// How long the loop may wait before a changed shard is due for its
+// hand-over, -1 if unchanged
+int snapshotTimeout() {
+    if (snapshot_path.empty() || !snapshotChanged()) {
+        return -1;
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next_snapshot - loop_now).count();
+    return std::max<int64_t>(0, left);
+}
+
+// ---- Interrupted matches ----
+
+// A match the last run left unfinished, waiting for its players
+struct InterruptedMatch {
+    std::string name1;
+    std::string name2;
+    uint8_t score1;
+    uint8_t score2;
+    uint16_t round;
+    int waiting_shard = -1;             // shard of the player back first, -1 = nobody yet
+    SessionId waiting_session = -1;
+    bool waiting_p1 = false;            // that player is name1
+    std::chrono::steady_clock::time_point expires;  // recorded as interrupted after this, unless someone waits
+};
+
+std::unordered_map<uint64_t, InterruptedMatch> interrupted_matches;  // by match id
+std::unordered_map<std::string, uint64_t> interrupted_by_name;       // both players' names -> match id
+std::mutex interrupted_lock;                                         // guards the two above
+std::atomic<bool> interrupted_pending(false);                        // any left (checked at login without the lock)
 
-        // Clear the set and rebuilds fd_set each iteration
-        FD_ZERO(&read_fds);
+// Recreates the game with its score and round once both players are back
+// on this shard
+void resumeMatch(uint64_t match_id, const InterruptedMatch& match, Player* a, Player* b) {
+    Player* p1 = a->name == match.name1 ? a : b;
+    Player* p2 = p1 == a ? b : a;
+    Game* game = game_pool.create(p1, p2);
+    game->match_id = match_id;
+    game->score1 = match.score1;
+    game->score2 = match.score2;
+    game->round = match.round;
+    addMetric(shard_metrics->games[(int)game->state]);
+    for (Player* player : {p1, p2}) {
+        player->resume_match = 0;
+        player->game = game;
+        setState(player, PlayerState::IN_GAME_CHOOSING);
+        armTimer(player, TimerKind::CHOICE);
+    }
+    markSnapshotDirty(game);
+    sendMatchResumed(p1, p2, game->score1, game->score2);
+    sendMatchResumed(p2, p1, game->score2, game->score1);
+    LOG(INFO) << "Resumed match " << p1->name << " vs " << p2->name << " at " << game->score1 << "-"
+              << game->score2 << " after " << game->round << " round(s)";
+}
 
-        // Add server socket to set, for new connections
-        FD_SET(server_fd, &read_fds);
-        int max_fd = server_fd; // used in select, records highest FD number
+// Puts a player back into their interrupted match, if they had one: at
+// login, and again when handed over to the shard of the opponent who came
+// back first. The first player back waits (IN_QUEUE but outside the
+// matchmaking queue, on the queue timeout); the second one is handed over
+// to that shard if needed and the game carries on there
+void rejoinInterruptedMatch(Player* player) {
+    bool arriving = player->resume_match != 0;
+    if (!arriving && !interrupted_pending.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int my_id = current_shard->id;
+    uint64_t match_id = 0;
+    InterruptedMatch resumed;
+    Player* opponent = nullptr;
+    int target = -1;
+    std::string opponent_name;
+    {
+        std::lock_guard<std::mutex> lock(interrupted_lock);
+        auto found = interrupted_by_name.find(player->name);
+        if (found != interrupted_by_name.end()) {
+            match_id = found->second;
+            InterruptedMatch& match = interrupted_matches[match_id];
+            bool is_p1 = match.name1 == player->name;
+            opponent_name = is_p1 ? match.name2 : match.name1;
+            bool opponent_waits = match.waiting_shard >= 0 && match.waiting_p1 != is_p1;
+            if (opponent_waits && match.waiting_shard == my_id) {
+                opponent = findPlayer(match.waiting_session);
+                if (opponent != nullptr && opponent->resume_match != match_id) {
+                    opponent = nullptr;
+                }
+            }
+            if (opponent != nullptr) {
+                resumed = match;
+                interrupted_by_name.erase(match.name1);
+                interrupted_by_name.erase(match.name2);
+                interrupted_matches.erase(match_id);
+                interrupted_pending = !interrupted_matches.empty();
+            } else if (opponent_waits && match.waiting_shard != my_id) {
+                target = match.waiting_shard;
+            } else {
+                match.waiting_shard = my_id;
+                match.waiting_session = player->session;
+                match.waiting_p1 = is_p1;
+            }
+        }
+    }
 
-        // Add all connected client sockets to detect messages sent
-        for (auto& pair : players) {
-            int socket = pair.first;
-            FD_SET(socket, &read_fds); // sets each client
-            // if the client is above the max, set new max
-            if (socket > max_fd) max_fd = socket;
+    if (match_id == 0) {
+        if (arriving) {
+            // Given up on while this player was on its way
+            player->resume_match = 0;
+            setState(player, PlayerState::CONNECTED);
+            sendTimedOut(player, BIN_TIMEOUT_QUEUE, REPLY_QUEUE_TIMED_OUT);
+            armTimer(player, TimerKind::IDLE);
         }
+        return;
+    }
+    if (opponent != nullptr) {
+        resumeMatch(match_id, resumed, opponent, player);
+        return;
+    }
+    if (!arriving) {
+        LOG(INFO) << player->name << " is back for the interrupted match against " << opponent_name;
+        setState(player, PlayerState::IN_QUEUE);
+        player->queued_at = loop_now;
+        player->resume_match = match_id;
+        sendMatchInterrupted(player, opponent_name);
+    }
+    armTimer(player, TimerKind::QUEUE);
+    if (target >= 0) {
+        resume_moves.push_back({refOf(player), target});
+    }
+}
 
-        // ---- Wait for Activity ----
+// A waiting player left (disconnect, queue timeout): the match waits for
+// whoever comes back first again
+void leaveInterruptedMatch(Player* player) {
+    std::lock_guard<std::mutex> lock(interrupted_lock);
+    auto it = interrupted_matches.find(player->resume_match);
+    if (it != interrupted_matches.end() && it->second.waiting_shard == current_shard->id &&
+        it->second.waiting_session == player->session) {
+        it->second.waiting_shard = -1;
+    }
+    player->resume_match = 0;
+}
 
-        // Block until activity on any socket
-        // select() returns when: new connection, client msg, or client disconnect
-        // Parameters:
-        // max_fd, read set, write set, exception set, timeout
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+// Writes an interrupted match's end to the history (no winner)
+void recordInterrupted(uint64_t match_id, const InterruptedMatch& match) {
+    LOG(INFO) << "Match " << match.name1 << " vs " << match.name2 << " was interrupted at "
+              << (int)match.score1 << "-" << (int)match.score2 << " after " << (int)match.round << " round(s)";
+    if (history_fd < 0) {
+        return;
+    }
+    HistoryRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.match_id = match_id;
+    record.player1 = internName(match.name1);
+    record.player2 = internName(match.name2);
+    record.type = HIST_MATCH;
+    record.score1 = match.score1;
+    record.score2 = match.score2;
+    record.flags = HIST_INTERRUPTED;
+    record.round = match.round;
+    std::lock_guard<std::mutex> lock(history_lock);
+    history_pending.push_back(record);
+    history_record_count++;
+}
 
-        if (activity < 0) { // Calls error if nothing is selected
-            std::cerr << "Select error" << std::endl;
-            continue; // Attempts call again
+// Gives up on the interrupted matches past their deadline that nobody
+// waits for (on all of them for a live upgrade, which does not carry them
+// over). Returns how many
+size_t endInterruptedMatches(bool all) {
+    if (!interrupted_pending.load()) {
+        return 0;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::vector<std::pair<uint64_t, InterruptedMatch>> ended;
+    {
+        std::lock_guard<std::mutex> lock(interrupted_lock);
+        for (auto it = interrupted_matches.begin(); it != interrupted_matches.end(); ) {
+            const InterruptedMatch& match = it->second;
+            if (all || (queue_timeout_s > 0 && match.waiting_shard < 0 && now >= match.expires)) {
+                interrupted_by_name.erase(match.name1);
+                interrupted_by_name.erase(match.name2);
+                ended.emplace_back(it->first, std::move(it->second));
+                it = interrupted_matches.erase(it);
+            } else {
+                ++it;
+            }
         }
+        interrupted_pending = !interrupted_matches.empty();
+    }
+    for (const auto& entry : ended) {
+        recordInterrupted(entry.first, entry.second);
+    }
+    return ended.size();
+}
 
-        // Checks if server socket has activity 
-        // FD_ISSET is used to check for activity
-        if (FD_ISSET(server_fd, &read_fds)) {
-            int addrlen = sizeof(address);
-            
-            // accepts client through creating new socket for the connection
-            int new_socket = accept(server_fd, (sockaddr*)&address, (socklen_t*)&addrlen);
+// ---- Writer ----
 
-            if (new_socket < 0) { // catches if not valid client
-                std::cerr << "Accept failed!" << std::endl;
-                continue;
+// A match in progress as the writer keeps it
+struct SnapshotMatch {
+    std::string name1;
+    std::string name2;
+    uint8_t score1 = 0;
+    uint8_t score2 = 0;
+    uint16_t round = 0;
+};
+
+void putSnapshotMatch(HandoffWriter& w, uint64_t match_id, const std::string& name1, const std::string& name2,
+                      uint8_t score1, uint8_t score2, uint16_t round) {
+    w.put(match_id);
+    w.putString(name1);
+    w.putString(name2);
+    w.put(score1);
+    w.put(score2);
+    w.put(round);
+}
+
+// Background writer: applies the shards' changes to its own copy of every
+// match and, once per interval when something changed, encodes it and
+// replaces the file. The first pass always writes (this run's match ids,
+// the interrupted matches).
+// A shard's history records are covered up to its last hand-over, or up to
+// now if it has handed over everything since: the count is read before the
+// shard's flag, and a shard flags itself before counting its records
+void snapshotWriterLoop() {
+    std::unordered_map<uint64_t, SnapshotMatch> matches;
+    std::vector<uint64_t> covered(snapshot_batches.size(), history_record_count.load());
+    std::vector<uint32_t> queued(snapshot_batches.size(), 0);
+    uint64_t covered_written = 0;
+    SnapshotBatch batch;
+    std::string out;
+    bool changed = true;
+    while (true) {
+        uint64_t records = history_record_count.load();
+        for (size_t id = 0; id < snapshot_batches.size(); id++) {
+            if (shards[id]->snapshot_clean.load()) {
+                covered[id] = std::max(covered[id], records);
+            }
+            {
+                std::lock_guard<std::mutex> lock(snapshot_lock);
+                SnapshotBatch& shared = snapshot_batches[id];
+                if (!shared.updated) {
+                    continue;
+                }
+                batch.changes.swap(shared.changes);
+                batch.names.swap(shared.names);
+                batch.history_records = shared.history_records;
+                batch.queued = shared.queued;
+                shared.updated = false;
+            }
+            size_t name_pos = 0;
+            for (const SnapshotChange& change : batch.changes) {
+                if (change.ended) {
+                    matches.erase(change.match_id);
+                    continue;
+                }
+                SnapshotMatch& match = matches[change.match_id];
+                if (change.named) {
+                    match.name1.assign(batch.names, name_pos, change.name1_len);
+                    match.name2.assign(batch.names, name_pos + change.name1_len, change.name2_len);
+                    name_pos += change.name1_len + change.name2_len;
+                }
+                match.score1 = change.score1;
+                match.score2 = change.score2;
+                match.round = change.round;
             }
+            covered[id] = std::max(covered[id], batch.history_records);
+            queued[id] = batch.queued;
+            batch.changes.clear();
+            batch.names.clear();
+            changed = true;
+        }
+        if (endInterruptedMatches(false) > 0) {
+            changed = true;
+        }
+        uint64_t covered_all = covered.empty() ? records : *std::min_element(covered.begin(), covered.end());
+        if (covered_all != covered_written) {
+            changed = true;
+        }
 
-            // Creates new player
-            Player* player = new Player(new_socket, "");
-            players[new_socket] = player;
+        if (changed) {
+            changed = false;
+            HistoryHeader header = makeHistoryHeader(SNAPSHOT_MAGIC, 0);
+            HandoffWriter w;
+            w.out.swap(out);
+            w.out.assign((const char*)&header, sizeof(header));
+            w.put((uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+            w.put(next_match_id.load());
+            w.put(covered_all);
+            covered_written = covered_all;
+            {
+                std::lock_guard<std::mutex> lock(interrupted_lock);
+                w.put((uint32_t)(matches.size() + interrupted_matches.size()));
+                for (const auto& entry : matches) {
+                    const SnapshotMatch& match = entry.second;
+                    putSnapshotMatch(w, entry.first, match.name1, match.name2, match.score1, match.score2, match.round);
+                }
+                for (const auto& entry : interrupted_matches) {
+                    const InterruptedMatch& match = entry.second;
+                    putSnapshotMatch(w, entry.first, match.name1, match.name2, match.score1, match.score2, match.round);
+                }
+            }
+            uint32_t queued_total = 0;
+            for (uint32_t count : queued) {
+                queued_total += count;
+            }
+            w.put(queued_total);
+            out.swap(w.out);
 
-            std::cout << "New client connected (socket " << new_socket << ")" << std::endl;
-            
+            int fd = replaceFile(snapshot_path, out);
+            if (fd < 0) {
+                LOG(ERROR) << "Snapshot write failed: " << (const char*)strerror(errno);
+            } else {
+                close(fd);
+            }
         }
+        std::this_thread::sleep_for(std::chrono::milliseconds(snapshot_interval_ms));
+    }
+}
+
+// Startup (after openHistory): reads the last run's snapshot, if any,
+// brings its matches up to date from the history and leaves those that
+// never finished waiting for their players. False if the file is not a
+// snapshot
+bool recoverSnapshot() {
+    int fd = open(snapshot_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return true; // clean start
+    }
+    std::string data;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, n);
+    }
+    close(fd);
+
+    HandoffReader r(data);
+    HistoryHeader header = r.get<HistoryHeader>();
+    if (!r.ok || !checkHistoryHeader(header, SNAPSHOT_MAGIC, 0)) {
+        std::cerr << snapshot_path << " is not a snapshot file of this version" << std::endl;
+        return false;
+    }
+    uint64_t written_us = r.get<uint64_t>();
+    uint64_t last_match_id = r.get<uint64_t>();
+    uint64_t replay_from = r.get<uint64_t>();
 
-        // ---- Check all clients for activity ----
-        // builds a list first for sockets to check to handle disconnect
-        std::vector<int> sockets_to_check;
-        for (auto& pair : players) {
-            sockets_to_check.push_back(pair.first);
+    std::unordered_map<uint64_t, InterruptedMatch> matches;
+    uint32_t match_count = r.get<uint32_t>();
+    for (uint32_t i = 0; i < match_count && r.ok; i++) {
+        uint64_t match_id = r.get<uint64_t>();
+        InterruptedMatch match;
+        match.name1 = r.getString();
+        match.name2 = r.getString();
+        match.score1 = r.get<uint8_t>();
+        match.score2 = r.get<uint8_t>();
+        match.round = r.get<uint16_t>();
+        if (r.ok) {
+            matches[match_id] = std::move(match);
         }
+    }
+    uint32_t queued = r.get<uint32_t>();
+    if (!r.ok) {
+        LOG(WARNING) << "Snapshot " << snapshot_path << " is cut short, recovering what was readable";
+    }
 
-        for (int socket : sockets_to_check) {
-            // verify player still exists
-            if (players.find(socket) == players.end()) {
-                continue;
+    // Resumed matches keep their ids, so this run's ids start past the
+    // last run's even if its last history record is an older match's
+    uint64_t next_run = ((last_match_id >> 32) + 1) << 32;
+    if (next_run > next_match_id.load()) {
+        next_match_id = next_run;
+    }
+
+    // History tail: scores are absolute, so records the snapshot already
+    // reflects are harmless to apply again
+    uint64_t replayed = 0;
+    uint64_t history_end = history_record_count.load();
+    if (history_fd >= 0 && !matches.empty() && replay_from < history_end) {
+        std::vector<HistoryRecord> records(4096);
+        for (uint64_t index = replay_from; index < history_end; ) {
+            size_t count = std::min<uint64_t>(records.size(), history_end - index);
+            off_t offset = sizeof(HistoryHeader) + index * sizeof(HistoryRecord);
+            if (pread(history_fd, records.data(), count * sizeof(HistoryRecord), offset) !=
+                (ssize_t)(count * sizeof(HistoryRecord))) {
+                LOG(ERROR) << "Can't read the match history tail: " << (const char*)strerror(errno);
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                const HistoryRecord& record = records[i];
+                auto it = matches.find(record.match_id);
+                if (it == matches.end()) {
+                    continue;
+                }
+                if (record.type == HIST_MATCH) {
+                    matches.erase(it); // finished before the crash
+                } else {
+                    it->second.score1 = record.score1;
+                    it->second.score2 = record.score2;
+                    it->second.round = record.round;
+                }
             }
+            index += count;
+            replayed += count;
+        }
+    }
 
-            // Checks for if data is ready
-            if (FD_ISSET(socket, &read_fds)) {
-                Player* player = players[socket];
-
-                // Reads data from given player
-                const int BUFFER_SIZE = 1024;
-                char buffer[BUFFER_SIZE];
-                memset(buffer, 0, sizeof(buffer));
-                int valread = read(socket, buffer, BUFFER_SIZE);
-
-                // Checks for disconnection
-                if (valread <= 0) { // if 0 = disconnection, 0 > means error
-                    // Client disconnected
-                    handleDisconnect(socket);
-                } else {     
-                    // Player sent message
-                    std::string message(buffer);
-
-                    // strips trailing newline/whitespace
-                    message.erase(message.find_last_not_of(" \n\r\t") + 1); 
-
-                    if (player->name.empty()) {
-                        // This is the username
-                        player->name = message;  
-                        std::cout << message << " has connected!" << std::endl;
-
-                        // Send game instructions
-                        std::string menu = "\n--- Rock Paper Scissors ---\n";
-                        menu += "Commands:\n";
-                        menu += "join - Join matchmaking queue\n";
-                        menu += "rock/paper/scissors - make your chioce\n";
-                        menu += "quit - Exits the game\n";
-
-                        send(socket, menu.c_str(), menu.length(), 0);
-                    } else {
-                        // ---- Command Parsing ----
-
-                        // Parse the command (lowercase for easier use)
-                        std::string command = message;
-                        std::transform(command.begin(), command.end(), command.begin(), ::tolower);
-
-                        std::cout << player->name << " sent: " << command << std::endl;
-
-                        // ---- Handle Commands ----
-
-                        if(command == "join") {
-                            // Player is looking to join matchmaking
-                            if (!requireState(socket, player, PlayerState::CONNECTED)) {
-                                continue; // continues early
-                            }
-                            handleJoinCommand(socket, player);
-                        }
-                        else if (command == "rock" || command == "paper" || command == "scissors")
-                        {
-                            // player choosing
-                            if (!requireState(socket, player, PlayerState::IN_GAME_CHOOSING)) {
-                                continue; // continues early
-                            }
-
-                            handleChoiceCommand(socket, player, command);
-                        }
-                        else if (command == "ready")
-                        {
-                            // Player is ready for next round
-                            if (!requireState(socket, player, PlayerState::VIEWING_RESULTS)) {
-                                continue; // continues early
-                            }
-                            handleReadyCommand(socket, player);
-                        }
-                        else if (command == "quit")
-                        {
-                            // Handles quit
-                            std::string msg = "Goodbye!\n";
-                            send(socket, msg.c_str(), msg.length(), 0);
-
-                            handleDisconnect(socket);
-                        }
-                        else
-                        {
-                            // Not valid command -> gives contextual help
-                            std::string msg = "Unknown command. ";
-
-                            if(player->state == PlayerState::CONNECTED) {
-                                msg += "Type 'join' to play!\n";
-                            } else if(player->state == PlayerState::IN_QUEUE) {
-                                msg += "You're in queue. Please wait for a match.\n";
-                            } else if(player->state == PlayerState::IN_GAME_CHOOSING) {
-                                msg += "Invalid choice! Type: rock, paper, or scissors\n";
-                            } else if(player->state == PlayerState::IN_GAME_WAITING) {
-                                msg += "Waiting for opponent to choose...";
-                            } else if(player->state == PlayerState::VIEWING_RESULTS) {
-                                msg += "Type 'ready' for next round!\n";
-                            } else {
-                                msg += "Type 'join' to play!\n";
-                            }
-
-                            send(socket, msg.c_str(), msg.length(), 0);
-                        }
-                    }
+    auto expires = std::chrono::steady_clock::now() + std::chrono::seconds(queue_timeout_s);
+    for (auto& entry : matches) {
+        InterruptedMatch& match = entry.second;
+        LOG(INFO) << "Match " << match.name1 << " vs " << match.name2 << " was interrupted at "
+                  << (int)match.score1 << "-" << (int)match.score2 << " after " << (int)match.round
+                  << " round(s), waiting for its players";
+        match.expires = expires;
+        interrupted_by_name[match.name1] = entry.first;
+        interrupted_by_name[match.name2] = entry.first;
+    }
+    interrupted_matches.swap(matches);
+    interrupted_pending = !interrupted_matches.empty();
+
+    uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    LOG(INFO) << "Recovered snapshot from " << (now_us - std::min(now_us, written_us)) / 1000 << " ms ago ("
+              << replayed << " history record(s) replayed): " << interrupted_matches.size()
+              << " interrupted match(es), " << queued << " queued player(s) dropped";
+    return true;
+}
+
+// ------------------- Journal Replay -------------------
+// --replay FILE runs a journal (--journal) through the handlers on one
+// shard, without sockets and on the journal's clock, as fast as it goes.
+// Its sessions have no handle, the replay is an in-process transport like
+// any other. At the end it prints the time taken and a
+// digest of all output: a build replays the same journal to the same
+// digest every time, so a different digest between builds means changed
+// behaviour. Built with -DGAME_PROFILING it also prints the per-handler
+// histograms, to compare their cost between builds
+
+// Stands in for the event backend: output is counted, hashed and dropped
+struct ReplayBackend : EventBackend {
+    uint64_t output_bytes = 0;
+    uint64_t digest = 14695981039346656037ull;    // FNV-1a over (session, output) in flush order
+
+    const char* name() override { return "replay"; }
+    bool init(int) override { return true; }
+    bool pauseReading(SessionId) override { return true; }
+    void resumeReading(SessionId) override {}
+    int detachSession(SessionId) override { return -1; }
+    void adoptClient(SessionId) override {}
+    void watchWakeup(int) override {}
+    void runOnce(int) override {}
+    void stopReading() override {}
+    bool busy() override { return false; }
+
+    // Last replies before the disconnect
+    void closeSession(SessionId session) override {
+        Player* player = findPlayer(session);
+        if (player != nullptr) {
+            flush(player);
+        }
+    }
+
+    void flush(Player* player) override {
+        size_t pending = player->pendingOutput();
+        if (pending == 0) {
+            return;
+        }
+        mix((const char*)&player->session, sizeof(player->session));
+        mix(player->output.data() + player->output_sent, pending);
+        output_bytes += pending;
+        addMetric(shard_metrics->output_bytes, -(int64_t)pending);
+        player->output.clear();
+        player->output_sent = 0;
+    }
+
+    void mix(const char* data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            digest = (digest ^ (uint8_t)data[i]) * 1099511628211ull;
+        }
+    }
+};
+
+int replayJournal(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(HistoryHeader)) {
+        std::cerr << "Can't open " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Can't map " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+    const char* pos = (const char*)mapped;
+    const char* end = pos + info.st_size;
+    HistoryHeader header;
+    memcpy(&header, pos, sizeof(header));
+    if (!checkHistoryHeader(header, JOURNAL_MAGIC, sizeof(JournalEntry))) {
+        std::cerr << path << " is not a journal file of this version" << std::endl;
+        return 1;
+    }
+    pos += sizeof(header);
+
+    // The game as it was when recording started
+    JournalSettings settings;
+    if ((size_t)(end - pos) < sizeof(settings)) {
+        std::cerr << path << " is cut off in its settings" << std::endl;
+        return 1;
+    }
+    memcpy(&settings, pos, sizeof(settings));
+    pos += sizeof(settings);
+    choice_timeout_s = settings.choice_timeout_s;
+    ready_timeout_s = settings.ready_timeout_s;
+    queue_timeout_s = settings.queue_timeout_s;
+    idle_timeout_s = settings.idle_timeout_s;
+    match_interval_ms = settings.match_interval_ms;
+    output_high_water = settings.max_output_bytes;
+    for (uint32_t i = 0; i < settings.player_count; i++) {
+        uint16_t len;
+        if ((size_t)(end - pos) < 2) {
+            break;
+        }
+        memcpy(&len, pos, 2);
+        if ((size_t)(end - pos) < 2 + len + sizeof(PlayerStats)) {
+            break;
+        }
+        PlayerStats stats;
+        memcpy(&stats, pos + 2 + len, sizeof(stats));
+        player_stats[std::string(pos + 2, len)] = stats;
+        pos += 2 + len + sizeof(PlayerStats);
+    }
+    if (player_stats.size() != settings.player_count) {
+        std::cerr << path << " is cut off in its player stats" << std::endl;
+        return 1;
+    }
+
+    // One shard on this thread, the clock only moves with the journal
+    Shard* shard = new Shard();
+    shard->id = 0;
+    shard->wakeup_fd = -1;
+    shard->listen_fd = -1;
+    shards.push_back(shard);
+    current_shard = shard;
+    shard_metrics = &shard->metrics;
+#ifdef GAME_PROFILING
+    initShardProfile();
+#endif
+    ReplayBackend* replay = new ReplayBackend();
+    backend = replay;
+    wheel_started = loop_now = std::chrono::steady_clock::time_point();
+
+    std::unordered_map<SessionId, SessionId> sessions;  // journal session -> replayed session
+    uint64_t connects = 0, chunks = 0, bytes_in = 0, iterations = 0;
+    uint64_t unknown = 0;   // entries for sessions the journal never connected
+    auto started = std::chrono::steady_clock::now();
+    while ((size_t)(end - pos) >= sizeof(JournalEntry)) {
+        JournalEntry entry;
+        memcpy(&entry, pos, sizeof(entry));
+        const char* data = pos + sizeof(entry);
+        if ((size_t)(end - data) < entry.length) {
+            break; // cut off mid-entry (the server was still writing)
+        }
+        pos = data + entry.length;
+        loop_now = wheel_started + std::chrono::nanoseconds(entry.time_ns);
+
+        auto session = sessions.find(entry.session);
+        switch (entry.type) {
+            case JOURNAL_CONNECT:
+                sessions[entry.session] = onClientConnected(-1);
+                connects++;
+                break;
+            case JOURNAL_DATA:
+                if (session != sessions.end()) {
+                    handleClientMessage(session->second, data, entry.length);
+                    chunks++;
+                    bytes_in += entry.length;
+                } else {
+                    unknown++;
+                }
+                break;
+            case JOURNAL_CLOSED:
+                if (session == sessions.end()) {
+                    unknown++;
+                } else if (findPlayer(session->second) != nullptr) {
+                    handleDisconnect(session->second);
+                }
+                break;
+            case JOURNAL_DROPPED:
+                if (session != sessions.end()) {
+                    disconnectLater(session->second);
+                } else {
+                    unknown++;
                 }
+                break;
+            case JOURNAL_ITERATION:
+                // Same stages as runShard()
+                advanceTimers();
+                runMatchmaking();
+                do {
+                    processPendingDisconnects();
+                    flushOutputs();
+                } while (!pending_disconnects.empty());
+                iterations++;
+                break;
+        }
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+    std::cout << "Replayed " << path << ": " << connects << " connection(s), " << chunks << " chunk(s) ("
+              << bytes_in << " bytes), " << iterations << " loop iteration(s) in " << elapsed_ms << " ms" << std::endl;
+    std::cout << "Games: " << shard->metrics.matches.load() << " match(es) started, " << shard->metrics.rounds.load()
+              << " round(s)" << std::endl;
+    std::cout << "Output: " << replay->output_bytes << " bytes, digest " << std::hex << replay->digest << std::dec
+              << std::endl;
+    if (unknown > 0) {
+        std::cout << "Skipped " << unknown << " entr" << (unknown == 1 ? "y" : "ies")
+                  << " for sessions the journal never connected (the replay does not match production)" << std::endl;
+    }
+#ifdef GAME_PROFILING
+    dumpProfiles();
+#endif
+    return 0;
+}
+
+// ------------------- Main -------------------
+
+// Creates the listening socket on port 8080 (-1 on failure)
+// reuse_port lets every shard bind its own socket and the kernel spreads
+// incoming connections across them
+int createServerSocket(bool reuse_port) {
+    // Create TCP socket
+    // uses AF_INET/IPv4 and SOCK_STREAM/TCP (stream oriented connection) for reliability
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0); 
+    if (server_fd == -1) { // if returned -1 the stops and fails creation
+        std::cerr << "Socket creation failed!" << std::endl;
+        return -1;
+    }
+
+    // Allows for resuse of address/port (saves time for quick restarts)
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        std::cerr << "setsockopt failed!" << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        std::cerr << "setsockopt SO_REUSEPORT failed!" << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    
+    // Configure server address
+    sockaddr_in address;
+    address.sin_family = AF_INET;         // IPv4
+    address.sin_addr.s_addr = INADDR_ANY; // Accept connections on any local network
+    address.sin_port = htons(8080);       // hosts on port 8080 using htons (Host To Network Short)
+    
+    // Bind socket to port 
+    if (::bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::cerr << "Bind failed!" << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    
+    // Listen for connections that are incoming
+    // Second parameter caps the queued connections (the kernel maximum, so
+    // a burst of thousands of connects isn't dropped and retried)
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        std::cerr << "Listen failed!" << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// Runs one shard's event loop on the calling thread
+void runShard(Shard* shard, int server_fd, bool use_io_uring) {
+    current_shard = shard;
+    shard_metrics = &shard->metrics;
+#ifdef GAME_PROFILING
+    initShardProfile();
+#endif
+
+    // Picks the event backend, io_uring falls back to epoll when the
+    // kernel does not support it
+    if (use_io_uring) {
+        backend = new UringBackend();
+        if (!backend->init(server_fd)) {
+            LOG(WARNING) << "io_uring unavailable, falling back to epoll";
+            delete backend;
+            backend = nullptr;
+        }
+    }
+    if (backend == nullptr) {
+        backend = new EpollBackend();
+        if (!backend->init(server_fd)) {
+            std::cerr << "epoll setup failed!" << std::endl;
+            exit(1);
+        }
+    }
+    backend->watchWakeup(shard->wakeup_fd);
+    wheel_started = loop_now = std::chrono::steady_clock::now();
+    LOG(INFO) << "Shard " << shard->id << " using " << backend->name() << " event backend";
+    restoreShards();
+
+    // Main Server loop
+    // Stops waiting for events early when a matchmaking pass, timer tick or
+    // snapshot is due, and polls while a live upgrade waits for I/O to settle
+    while (true) {
+        int timeout = loopTimeout();
+        int snapshot_ms = snapshotTimeout();
+        if (snapshot_ms >= 0) {
+            timeout = timeout < 0 ? snapshot_ms : std::min(timeout, snapshot_ms);
+        }
+        backend->runOnce(upgrade_stopped ? 10 : timeout);
+#ifdef GAME_PROFILING
+        // The signal interrupts the wait of whichever shard received it
+        if (profile_dump_requested.exchange(false)) {
+            dumpProfiles();
+        }
+#endif
+        advanceTimers();
+        runMatchmaking();
+        balanceLonePlayer();
+        moveResumingPlayers();
+
+        // Disconnect notices produce output and failed writes produce
+        // disconnects, so repeats until both settle
+        do {
+            processPendingDisconnects();
+            flushOutputs();
+        } while (!pending_disconnects.empty());
+        submitHistory();
+        submitJournal();
+        snapshotStep();
+        if (upgradeStep()) {
+            return;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+// ----- Options -----
+    bool use_io_uring = false;
+    int num_threads = 1;
+    std::string history_path;
+    std::string stats_file;
+    int admin_port = 0;
+    std::string upgrade_path;
+    std::string journal_path;
+    std::string replay_path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--io-uring") {
+            use_io_uring = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (arg == "--max-output-bytes" && i + 1 < argc) {
+            output_high_water = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--match-interval-ms" && i + 1 < argc) {
+            match_interval_ms = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--choice-timeout" && i + 1 < argc) {
+            choice_timeout_s = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--ready-timeout" && i + 1 < argc) {
+            ready_timeout_s = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--queue-timeout" && i + 1 < argc) {
+            queue_timeout_s = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--idle-timeout" && i + 1 < argc) {
+            idle_timeout_s = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--history" && i + 1 < argc) {
+            history_path = argv[++i];
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            admin_port = atoi(argv[++i]);
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_file = argv[++i];
+        } else if (arg == "--upgrade-socket" && i + 1 < argc) {
+            upgrade_path = argv[++i];
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journal_path = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (arg == "--snapshot-interval-ms" && i + 1 < argc) {
+            snapshot_interval_ms = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--history-sync-ms" && i + 1 < argc) {
+            history_sync_ms = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--log-level" && i + 1 < argc && parseLogLevel(argv[i + 1]) >= 0) {
+            log_level = (LogLevel)parseLogLevel(argv[++i]);
+        } else if (arg == "--log-sample" && i + 1 < argc && strchr(argv[i + 1], '=') != NULL) {
+            // LEVEL=N keeps 1 in N lines of that level
+            std::string setting = argv[++i];
+            size_t eq = setting.find('=');
+            int level = parseLogLevel(setting.substr(0, eq));
+            int every = atoi(setting.c_str() + eq + 1);
+            if (level < 0 || every < 1) {
+                num_threads = 0;
+                break;
             }
+            log_sample_every[level] = every;
+        } else {
+            num_threads = 0; // falls through to usage
+            break;
+        }
+    }
+    if (num_threads < 1) {
+        std::cerr << "Usage: " << argv[0] << " [--io-uring] [--threads N] [--max-output-bytes N] [--match-interval-ms N]"
+                  << " [--choice-timeout S] [--ready-timeout S] [--queue-timeout S] [--idle-timeout S]"
+                  << " [--history FILE] [--history-sync-ms N] [--stats FILE] [--admin-port N]"
+                  << " [--snapshot FILE] [--snapshot-interval-ms N] [--upgrade-socket PATH] [--journal FILE]"
+                  << " [--log-level debug|info|warning|error] [--log-sample LEVEL=N]" << std::endl;
+        std::cerr << "       " << argv[0] << " --replay FILE [--log-level LEVEL] (runs a journal without sockets)" << std::endl;
+        return 1;
+    }
+    if (!journal_path.empty() && num_threads > 1) {
+        std::cerr << "--journal records a single shard, run it with --threads 1" << std::endl;
+        return 1;
+    }
+    // The journal only carries the options and stats it started from, not
+    // recovered matches or taken-over sessions, so it could not replay them
+    if (!journal_path.empty() && (!snapshot_path.empty() || !upgrade_path.empty())) {
+        std::cerr << "--journal can't be combined with --snapshot or --upgrade-socket" << std::endl;
+        return 1;
+    }
+
+// ----- Journal Replay -----
+    if (!replay_path.empty()) {
+        std::thread(logWriterLoop).detach();
+        int status = replayJournal(replay_path);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); // last log lines
+        _exit(status);
+    }
+
+// ----- Live Upgrade -----
+    // A server already running on the upgrade socket hands over its sockets
+    // and state (before the history/stats files are opened, it syncs them first)
+    int upgrade_fd = -1;
+    if (!upgrade_path.empty()) {
+        if (receiveTakeover(upgrade_path) < 0) {
+            return 1;
         }
+        upgrade_fd = createUpgradeSocket(upgrade_path);
+        if (upgrade_fd < 0) {
+            return 1;
+        }
+    }
+
+// ----- Socket Setup -----
+    // One listening socket per shard, all bound to the same port. Taken
+    // over ones are reused (with fewer shards than before, the extra ones
+    // are closed and connections still in their backlog are reset); they
+    // always have SO_REUSEPORT with an upgrade socket, so the shard count
+    // can change between upgrades
+    std::vector<int> server_fds;
+    for (int i = 0; i < num_threads; i++) {
+        int server_fd;
+        if (i < (int)takeover_listen_fds.size()) {
+            server_fd = takeover_listen_fds[i];
+        } else {
+            server_fd = createServerSocket(num_threads > 1 || !upgrade_path.empty());
+        }
+        if (server_fd < 0) {
+            return 1;
+        }
+        server_fds.push_back(server_fd);
+
+        Shard* shard = new Shard();
+        shard->id = i;
+        shard->listen_fd = server_fd;
+        shard->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+        if (shard->wakeup_fd < 0) {
+            std::cerr << "eventfd failed!" << std::endl;
+            return 1;
+        }
+        shards.push_back(shard);
+    }
+    for (size_t i = num_threads; i < takeover_listen_fds.size(); i++) {
+        close(takeover_listen_fds[i]);
+    }
+    
+    std::cout << "Server listening on port 8080 with " << num_threads << " shard(s)..." << std::endl;
+    std::thread(logWriterLoop).detach();
+    if (!history_path.empty()) {
+        if (!openHistory(history_path)) {
+            return 1;
+        }
+        std::thread(historyWriterLoop).detach();
+    }
+    if (!stats_file.empty()) {
+        if (!openStats(stats_file)) {
+            return 1;
+        }
+        std::thread(statsWriterLoop).detach();
+    }
+    if (!journal_path.empty()) {
+        if (!openJournal(journal_path)) {
+            return 1;
+        }
+        std::thread(journalWriterLoop).detach();
+    }
+    if (!snapshot_path.empty()) {
+        // After a live upgrade the snapshot's matches are still running
+        if (takeover_shards.empty() && !recoverSnapshot()) {
+            return 1;
+        }
+        snapshot_batches.resize(num_threads);
+        std::thread(snapshotWriterLoop).detach();
+    }
+    if (takeover_admin_fd >= 0 && (admin_port <= 0 || socketPort(takeover_admin_fd) != admin_port)) {
+        close(takeover_admin_fd);
+        takeover_admin_fd = -1;
+    }
+    if (admin_port > 0) {
+        int admin_fd = takeover_admin_fd >= 0 ? takeover_admin_fd : createAdminSocket(admin_port);
+        if (admin_fd < 0) {
+            return 1;
+        }
+        admin_listen_fd = admin_fd;
+        std::thread(adminLoop, admin_fd).detach();
+        std::cout << "Metrics on http://127.0.0.1:" << admin_port << "/metrics (and /metrics.json)" << std::endl;
+    }
+
+#ifdef GAME_PROFILING
+    // SIGUSR1 prints the latency profile (no SA_RESTART, so it wakes the loop)
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfileSignal;
+    sigaction(SIGUSR1, &action, NULL);
+    std::cout << "Profiling enabled, kill -USR1 " << getpid() << " prints latency histograms" << std::endl;
+#endif
+
+    // ----- EVENT LOOP -----
+
+    std::thread upgrade_thread;
+    if (upgrade_fd >= 0) {
+        upgrade_thread = std::thread(upgradeListenerLoop, upgrade_fd);
+    }
+
+    // Shard 0 runs on the main thread, the rest get their own
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++) {
+        threads.emplace_back(runShard, shards[i], server_fds[i], use_io_uring);
     }
+    runShard(shards[0], server_fds[0], use_io_uring);
     
-    // Never used but allows for better closing of server
-    close(server_fd); 
+    // Shards only return once handed over to a new process
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (upgrade_thread.joinable()) {
+        upgrade_thread.join();
+        // Gives the log writer a moment for the last lines; the writer
+        // threads are still running, so static destructors are skipped
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        _exit(0);
+    }
+    for (int server_fd : server_fds) {
+        close(server_fd); 
+    }
     return 0; 
-}
\ No newline at end of file
+}
@@ -0,0 +1,289 @@
+/*
+Rock-Paper-Scissors Match History Reader
+
+Offline stats over the files game_server.cpp writes with --history FILE
+(format in match_history.h). Both files are mapped read-only and the
+fixed-size records are scanned in place, nothing is parsed or copied, so
+hundreds of millions of records take one sequential pass over the disk.
+Safe to run while the server is appending, it reads what was there when
+it started.
+
+*/
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include "match_history.h"
+
+// --------- Mapped Files ---------
+
+// Read-only mapping of one history file, data is what follows the header
+struct MappedFile {
+    const char* base = nullptr;
+    size_t size = 0;
+    const char* data = nullptr;
+    size_t data_size = 0;
+
+    bool open(const std::string& path, const char* magic, uint32_t record_size) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) < 0) {
+            std::cerr << "Can't open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        size = info.st_size;
+        if (size < sizeof(HistoryHeader)) {
+            std::cerr << path << " is too short for a match history file" << std::endl;
+            return false;
+        }
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Can't map " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        base = (const char*)mapped;
+        madvise(mapped, size, MADV_SEQUENTIAL);
+
+        HistoryHeader header;
+        memcpy(&header, base, sizeof(header));
+        if (!checkHistoryHeader(header, magic, record_size)) {
+            std::cerr << path << " is not a match history file of this version" << std::endl;
+            return false;
+        }
+        data = base + sizeof(HistoryHeader);
+        data_size = size - sizeof(HistoryHeader);
+        return true;
+    }
+};
+
+// --------- Statistics ---------
+
+const char* CHOICE_NAMES[4] = {"none", "rock", "paper", "scissors"};
+
+struct PlayerStats {
+    uint64_t matches = 0;
+    uint64_t wins = 0;
+    uint64_t losses = 0;
+    uint64_t forfeits = 0;      // matches this player forfeited
+    uint64_t rounds = 0;
+    uint64_t round_wins = 0;
+    uint64_t ties = 0;
+    uint64_t choices[4] = {};
+};
+
+struct Totals {
+    uint64_t records = 0;
+    uint64_t rounds = 0;
+    uint64_t ties = 0;
+    uint64_t matches = 0;
+    uint64_t forfeits_disconnect = 0;
+    uint64_t forfeits_timeout = 0;
+    uint64_t interrupted = 0;       // by a server crash, counted as played but not won
+    uint64_t unknown_names = 0;     // ids past the name table (table not synced yet)
+    uint64_t choices[4] = {};
+    uint64_t first_us = 0;
+    uint64_t last_us = 0;
+};
+
+// 0 = tie, 1 = player 1 wins, 2 = player 2 wins (same rules as Game::getRoundWinner)
+int roundWinner(uint8_t choice1, uint8_t choice2) {
+    if (choice1 == choice2) return 0;
+    if ((choice1 == 1 && choice2 == 3) || (choice1 == 2 && choice2 == 1) || (choice1 == 3 && choice2 == 2)) return 1;
+    return 2;
+}
+
+// One pass over the records: totals plus per-player stats indexed by name id
+void scan(const HistoryRecord* records, size_t count, Totals& totals, std::vector<PlayerStats>& players) {
+    totals.records = count;
+    if (count > 0) {
+        totals.first_us = records[0].timestamp_us;
+        totals.last_us = records[count - 1].timestamp_us;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const HistoryRecord& record = records[i];
+        if (record.player1 >= players.size() || record.player2 >= players.size()) {
+            totals.unknown_names++;
+            continue;
+        }
+        PlayerStats& p1 = players[record.player1];
+        PlayerStats& p2 = players[record.player2];
+
+        if (record.type == HIST_ROUND) {
+            uint8_t c1 = record.choice1 & 3;
+            uint8_t c2 = record.choice2 & 3;
+            totals.rounds++;
+            totals.choices[c1]++;
+            totals.choices[c2]++;
+            p1.rounds++;
+            p2.rounds++;
+            p1.choices[c1]++;
+            p2.choices[c2]++;
+            int winner = roundWinner(c1, c2);
+            if (winner == 0) {
+                totals.ties++;
+                p1.ties++;
+                p2.ties++;
+            } else {
+                (winner == 1 ? p1 : p2).round_wins++;
+            }
+        } else if (record.type == HIST_MATCH) {
+            totals.matches++;
+            p1.matches++;
+            p2.matches++;
+            if (record.flags & HIST_INTERRUPTED) {
+                totals.interrupted++;
+                continue;
+            }
+            bool p1_won;
+            if (record.flags & HIST_FORFEIT) {
+                bool p1_forfeited = record.flags & HIST_FORFEIT_P1;
+                (p1_forfeited ? p1 : p2).forfeits++;
+                p1_won = !p1_forfeited;
+                if (record.flags & HIST_FORFEIT_TIMEOUT) {
+                    totals.forfeits_timeout++;
+                } else {
+                    totals.forfeits_disconnect++;
+                }
+            } else {
+                p1_won = record.score1 > record.score2;
+            }
+            (p1_won ? p1 : p2).wins++;
+            (p1_won ? p2 : p1).losses++;
+        }
+    }
+}
+
+// --------- Report ---------
+
+double percent(uint64_t part, uint64_t whole) {
+    return whole == 0 ? 0 : 100.0 * part / whole;
+}
+
+std::string formatTime(uint64_t timestamp_us) {
+    time_t seconds = timestamp_us / 1000000;
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+    return buffer;
+}
+
+void printChoices(const uint64_t choices[4]) {
+    uint64_t total = choices[1] + choices[2] + choices[3];
+    for (int c = 1; c <= 3; c++) {
+        std::cout << " " << CHOICE_NAMES[c] << " " << percent(choices[c], total) << "%";
+    }
+    std::cout << std::endl;
+}
+
+void printPlayer(std::string_view name, const PlayerStats& stats) {
+    std::cout << name << ": " << stats.matches << " matches, " << stats.wins << " won ("
+              << percent(stats.wins, stats.matches) << "%), " << stats.losses << " lost, "
+              << stats.forfeits << " forfeited" << std::endl;
+    std::cout << "  " << stats.rounds << " rounds, " << stats.round_wins << " won, " << stats.ties << " tied, chose:";
+    printChoices(stats.choices);
+}
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " FILE [--top N] [--player NAME]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string path = argv[1];
+    int top = 10;
+    std::string only_player;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--top" && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (arg == "--player" && i + 1 < argc) {
+            only_player = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Name table: id -> name, pointing into the mapping
+    MappedFile names_file;
+    if (!names_file.open(path + ".names", HISTORY_NAMES_MAGIC, 0)) {
+        return 1;
+    }
+    std::vector<std::string_view> names;
+    size_t pos = 0;
+    while (pos + 2 <= names_file.data_size) {
+        uint16_t len;
+        memcpy(&len, names_file.data + pos, 2);
+        if (pos + 2 + len > names_file.data_size) {
+            break; // torn entry, the server cuts it on its next start
+        }
+        names.emplace_back(names_file.data + pos + 2, len);
+        pos += 2 + len;
+    }
+
+    MappedFile records_file;
+    if (!records_file.open(path, HISTORY_MAGIC, sizeof(HistoryRecord))) {
+        return 1;
+    }
+    // The header keeps records 8-byte aligned in the page-aligned mapping
+    const HistoryRecord* records = (const HistoryRecord*)records_file.data;
+    size_t count = records_file.data_size / sizeof(HistoryRecord);
+
+    Totals totals;
+    std::vector<PlayerStats> players(names.size());
+    scan(records, count, totals, players);
+
+    if (!only_player.empty()) {
+        auto it = std::find(names.begin(), names.end(), only_player);
+        if (it == names.end()) {
+            std::cerr << "No player named " << only_player << std::endl;
+            return 1;
+        }
+        printPlayer(*it, players[it - names.begin()]);
+        return 0;
+    }
+
+    std::cout << count << " records, " << names.size() << " players";
+    if (count > 0) {
+        std::cout << ", " << formatTime(totals.first_us) << " to " << formatTime(totals.last_us);
+    }
+    std::cout << std::endl;
+    std::cout << "Rounds: " << totals.rounds << " (" << percent(totals.ties, totals.rounds) << "% ties), chose:";
+    printChoices(totals.choices);
+    std::cout << "Matches: " << totals.matches << ", forfeited by disconnect " << totals.forfeits_disconnect
+              << ", by timeout " << totals.forfeits_timeout << ", interrupted " << totals.interrupted << std::endl;
+    if (totals.unknown_names > 0) {
+        std::cout << "Skipped " << totals.unknown_names << " record(s) with names missing from the name table" << std::endl;
+    }
+
+    // Most match wins first
+    std::vector<uint32_t> order(names.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    size_t shown = std::min<size_t>(std::max(top, 0), order.size());
+    std::partial_sort(order.begin(), order.begin() + shown, order.end(), [&](uint32_t a, uint32_t b) {
+        return players[a].wins > players[b].wins;
+    });
+    if (shown > 0) {
+        std::cout << std::endl << "Top " << shown << " by match wins:" << std::endl;
+    }
+    for (size_t i = 0; i < shown; i++) {
+        printPlayer(names[order[i]], players[order[i]]);
+    }
+    return 0;
+}
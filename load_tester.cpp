@@ -0,0 +1,532 @@
+/*
+Rock-Paper-Scissors Load Tester
+
+Headless version of player.cpp: one process drives thousands of bot
+connections over epoll instead of one interactive connection over threads.
+Each bot sends its username, joins the queue and plays full matches
+(random or scripted choices), rejoining when a match ends. Reports
+rounds/sec while running and latency percentiles at the end. Bots speak
+the text protocol, or the binary one (binary_protocol.h) with --binary.
+
+*/
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include "binary_protocol.h"
+
+using Clock = std::chrono::steady_clock;
+
+// --------- Settings ---------
+
+struct Settings {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int bots = 1000;             // concurrent connections
+    int connect_rate = 5000;     // new connections per second
+    int duration_s = 10;         // run time once the first bot connects
+    int think_ms = 0;            // delay before each choice/ready/join
+    std::vector<std::string> script;  // choices to cycle through (random when empty)
+    bool binary = false;         // binary protocol instead of text
+};
+
+Settings settings;
+
+// --------- Bots ---------
+
+// What a bot sent last and is waiting to hear back about
+enum class Command { NONE, JOIN, CHOICE, READY };
+
+struct Bot {
+    int fd = -1;
+    bool connected = false;
+    std::string input;           // partial line from the server
+    std::string output;          // commands the socket didn't take yet
+    Command pending = Command::NONE;
+    Clock::time_point sent_at;   // when 'pending' was sent
+    Clock::time_point joined_at; // when the last join was sent
+    size_t script_pos = 0;
+};
+
+std::vector<Bot> bots;
+int epoll_fd;
+std::mt19937 rng(12345);
+
+// Commands waiting out their think time, earliest first
+struct Timer {
+    Clock::time_point due;
+    int bot;
+    Command command;
+    bool operator>(const Timer& other) const { return due > other.due; }
+};
+std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+
+// --------- Statistics ---------
+
+// Latency samples in microseconds, sorted once at the end for percentiles
+struct Latency {
+    const char* name;
+    std::vector<uint32_t> samples;
+
+    explicit Latency(const char* n) : name(n) {}
+
+    void add(Clock::duration d) {
+        samples.push_back((uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+    }
+
+    void report() {
+        if (samples.empty()) {
+            std::cout << "  " << name << ": no samples" << std::endl;
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        auto at = [&](double q) { return samples[std::min(samples.size() - 1, (size_t)(q * samples.size()))]; };
+        std::cout << "  " << name << " (" << samples.size() << " samples): p50 " << at(0.50)
+                  << " us, p99 " << at(0.99) << " us, p999 " << at(0.999)
+                  << " us, max " << samples.back() << " us" << std::endl;
+    }
+};
+
+Latency match_latency("join -> match found");
+Latency join_latency("join reply");
+Latency choice_latency("choice reply");
+Latency ready_latency("ready reply");
+
+uint64_t round_results = 0;     // ROUND RESULT lines seen (two per round)
+uint64_t matches_finished = 0;  // GAME OVER lines seen (two per match)
+uint64_t disconnects = 0;
+uint64_t connect_failures = 0;
+
+// --------- Sending ---------
+
+void flushBot(int id) {
+    Bot& bot = bots[id];
+    while (!bot.output.empty()) {
+        ssize_t sent = send(bot.fd, bot.output.data(), bot.output.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent <= 0) {
+            break; // EAGAIN: EPOLLOUT picks it up, errors show up as a read failure
+        }
+        bot.output.erase(0, sent);
+    }
+    if (!bot.output.empty() && bot.connected) {
+        // Socket full, finishes on EPOLLOUT
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u32 = id;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, bot.fd, &ev);
+    }
+}
+
+void sendCommand(int id, Command command) {
+    Bot& bot = bots[id];
+    if (bot.fd < 0) {
+        return;
+    }
+    static const char* choices[] = {"rock", "paper", "scissors"};
+    std::string choice;
+    if (command == Command::JOIN) {
+        bot.joined_at = Clock::now();
+    } else if (command == Command::CHOICE) {
+        if (settings.script.empty()) {
+            choice = choices[rng() % 3];
+        } else {
+            choice = settings.script[bot.script_pos++ % settings.script.size()];
+        }
+    }
+
+    if (settings.binary) {
+        if (command == Command::JOIN) {
+            appendFrame(bot.output, BIN_JOIN, NULL, 0);
+        } else if (command == Command::READY) {
+            appendFrame(bot.output, BIN_READY, NULL, 0);
+        } else {
+            char value = choice == "rock" ? BIN_ROCK : choice == "paper" ? BIN_PAPER : BIN_SCISSORS;
+            appendFrame(bot.output, BIN_CHOICE, &value, 1);
+        }
+    } else {
+        if (command == Command::JOIN) {
+            bot.output += "join\n";
+        } else if (command == Command::READY) {
+            bot.output += "ready\n";
+        } else {
+            bot.output += choice + "\n";
+        }
+    }
+    bot.pending = command;
+    bot.sent_at = Clock::now();
+    flushBot(id);
+}
+
+// Sends now, or after a randomized think time (50-150% of --think-ms)
+void scheduleCommand(int id, Command command) {
+    if (settings.think_ms <= 0) {
+        sendCommand(id, command);
+        return;
+    }
+    int delay = settings.think_ms / 2 + (int)(rng() % (settings.think_ms + 1));
+    timers.push({Clock::now() + std::chrono::milliseconds(delay), id, command});
+}
+
+// --------- Protocol ---------
+
+// First message after a command is its reply
+void recordReply(Bot& bot, Clock::time_point now) {
+    if (bot.pending == Command::NONE) {
+        return;
+    }
+    if (bot.pending == Command::JOIN) join_latency.add(now - bot.sent_at);
+    if (bot.pending == Command::CHOICE) choice_latency.add(now - bot.sent_at);
+    if (bot.pending == Command::READY) ready_latency.add(now - bot.sent_at);
+    bot.pending = Command::NONE;
+}
+
+// Reacts to one line from the server, mirroring what a person at
+// player.cpp would type next
+void handleLine(int id, const std::string& line) {
+    Bot& bot = bots[id];
+    auto now = Clock::now();
+    if (!line.empty()) {
+        recordReply(bot, now);
+    }
+
+    if (line.rfind("quit - ", 0) == 0) {
+        // End of the welcome menu
+        scheduleCommand(id, Command::JOIN);
+    } else if (line.rfind("Playing against:", 0) == 0) {
+        match_latency.add(now - bot.joined_at);
+    } else if (line.rfind("Choose: rock", 0) == 0 || line.rfind("Type: rock", 0) == 0) {
+        scheduleCommand(id, Command::CHOICE);
+    } else if (line == "--- ROUND RESULT ---") {
+        round_results++;
+    } else if (line == "Type 'ready' for next round!") {
+        scheduleCommand(id, Command::READY);
+    } else if (line.rfind("--- GAME OVER", 0) == 0) {
+        matches_finished++;
+    } else if (line.rfind("Type 'join' to", 0) == 0) {
+        // Match over (or opponent left), back into the queue
+        scheduleCommand(id, Command::JOIN);
+    }
+}
+
+// Same flow as handleLine, for binary frames
+void handleFrame(int id, uint8_t op, const char* payload, uint32_t len) {
+    Bot& bot = bots[id];
+    auto now = Clock::now();
+    recordReply(bot, now);
+
+    if (op == BIN_WELCOME || op == BIN_OPPONENT_LEFT || op == BIN_OPPONENT_TIMED_OUT) {
+        scheduleCommand(id, Command::JOIN);
+    } else if (op == BIN_TIMED_OUT && len == 1 && payload[0] != BIN_TIMEOUT_IDLE) {
+        scheduleCommand(id, Command::JOIN);
+    } else if (op == BIN_MATCH_FOUND) {
+        match_latency.add(now - bot.joined_at);
+        scheduleCommand(id, Command::CHOICE);
+    } else if (op == BIN_NEW_ROUND) {
+        scheduleCommand(id, Command::CHOICE);
+    } else if (op == BIN_ROUND_RESULT && len == 6) {
+        round_results++;
+        if (payload[5] & BIN_FLAG_GAME_OVER) {
+            matches_finished++;
+            scheduleCommand(id, Command::JOIN);
+        } else {
+            scheduleCommand(id, Command::READY);
+        }
+    }
+}
+
+void closeBot(int id) {
+    Bot& bot = bots[id];
+    if (bot.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot.fd, NULL);
+        close(bot.fd);
+        bot.fd = -1;
+    }
+}
+
+void readBot(int id) {
+    Bot& bot = bots[id];
+    char buffer[4096];
+    while (true) {
+        ssize_t n = recv(bot.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            disconnects++;
+            closeBot(id);
+            return;
+        }
+        bot.input.append(buffer, n);
+
+        if (settings.binary) {
+            size_t start = 0;
+            uint8_t op;
+            const char* payload;
+            uint32_t payload_len;
+            size_t frame_len;
+            int parsed;
+            while ((parsed = parseFrame(bot.input.data() + start, bot.input.size() - start,
+                                        op, payload, payload_len, frame_len)) > 0) {
+                handleFrame(id, op, payload, payload_len);
+                start += frame_len;
+            }
+            if (parsed < 0) {
+                disconnects++;
+                closeBot(id);
+                return;
+            }
+            bot.input.erase(0, start);
+            continue;
+        }
+
+        size_t start = 0, end;
+        while ((end = bot.input.find('\n', start)) != std::string::npos) {
+            handleLine(id, bot.input.substr(start, end - start));
+            if (bot.fd < 0) {
+                return;
+            }
+            start = end + 1;
+        }
+        bot.input.erase(0, start);
+    }
+}
+
+// --------- Connections ---------
+
+// Starts a non-blocking connect. Loopback runs of more than ~20k bots
+// spread over several 127.0.0.x source addresses, one address alone runs
+// out of ephemeral ports
+bool startConnect(int id, const sockaddr_in& server_addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        connect_failures++;
+        return false;
+    }
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    if ((ntohl(server_addr.sin_addr.s_addr) >> 24) == 127) {
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &opt, sizeof(opt));
+        sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(0x7f000001 + id / 20000);
+        bind(fd, (sockaddr*)&local, sizeof(local));
+    }
+
+    if (connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        connect_failures++;
+        close(fd);
+        return false;
+    }
+
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.u32 = id;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    bots[id].fd = fd;
+    return true;
+}
+
+// Connect finished (or failed): sends the username like player.cpp does
+void onConnected(int id) {
+    Bot& bot = bots[id];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(bot.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+        connect_failures++;
+        closeBot(id);
+        return;
+    }
+    bot.connected = true;
+    std::string name = "bot" + std::to_string(id);
+    if (settings.binary) {
+        bot.output += (char)BINARY_PROTOCOL_MAGIC;
+        appendFrame(bot.output, BIN_HELLO, name.data(), name.size());
+    } else {
+        bot.output += name + "\n";
+    }
+    flushBot(id);
+}
+
+// --------- Main ---------
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [--host IP] [--port N] [--bots N] [--connect-rate N]"
+              << " [--duration S] [--think-ms N] [--script rock,paper,...] [--binary]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--binary") {
+            settings.binary = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--host") settings.host = value;
+        else if (arg == "--port") settings.port = atoi(value.c_str());
+        else if (arg == "--bots") settings.bots = atoi(value.c_str());
+        else if (arg == "--connect-rate") settings.connect_rate = atoi(value.c_str());
+        else if (arg == "--duration") settings.duration_s = atoi(value.c_str());
+        else if (arg == "--think-ms") settings.think_ms = atoi(value.c_str());
+        else if (arg == "--script") {
+            size_t start = 0, comma;
+            while ((comma = value.find(',', start)) != std::string::npos) {
+                settings.script.push_back(value.substr(start, comma - start));
+                start = comma + 1;
+            }
+            settings.script.push_back(value.substr(start));
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (settings.bots < 1 || settings.connect_rate < 1 || settings.duration_s < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // One descriptor per bot, raises the soft limit as far as allowed
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(settings.port);
+    if (inet_pton(AF_INET, settings.host.c_str(), &server_addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address!" << std::endl;
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        std::cerr << "epoll setup failed!" << std::endl;
+        return 1;
+    }
+    bots.resize(settings.bots);
+    std::cout << "Driving " << settings.bots << " bots against " << settings.host << ":" << settings.port
+              << " for " << settings.duration_s << "s" << std::endl;
+
+    // --------- Event Loop ---------
+
+    const int MAX_EVENTS = 1024;
+    epoll_event events[MAX_EVENTS];
+    auto start = Clock::now();
+    auto end = start + std::chrono::seconds(settings.duration_s);
+    auto next_report = start + std::chrono::seconds(1);
+    int started = 0;
+    uint64_t last_rounds = 0;
+
+    while (Clock::now() < end) {
+        auto now = Clock::now();
+
+        // Ramps connections up at --connect-rate
+        double elapsed_s = std::chrono::duration<double>(now - start).count();
+        int target = std::min(settings.bots, (int)(elapsed_s * settings.connect_rate) + 1);
+        while (started < target) {
+            startConnect(started, server_addr);
+            started++;
+        }
+
+        // Sends commands whose think time is up
+        while (!timers.empty() && timers.top().due <= now) {
+            Timer timer = timers.top();
+            timers.pop();
+            sendCommand(timer.bot, timer.command);
+        }
+
+        if (now >= next_report) {
+            int connected = 0;
+            for (Bot& bot : bots) {
+                connected += bot.fd >= 0 && bot.connected;
+            }
+            std::cout << "[" << (int)elapsed_s << "s] connected " << connected << "/" << settings.bots
+                      << ", rounds/sec " << (round_results - last_rounds) / 2
+                      << ", matches finished " << matches_finished / 2 << std::endl;
+            last_rounds = round_results;
+            next_report += std::chrono::seconds(1);
+        }
+
+        // Sleeps until the next timer, ramp step or report is due (1 ms granularity)
+        int timeout = 1000;
+        if (started < settings.bots) timeout = 1;
+        if (!timers.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(timers.top().due - now).count();
+            timeout = std::min(timeout, (int)std::max<int64_t>(wait, 0));
+        }
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "epoll_wait error" << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int id = events[i].data.u32;
+            if (bots[id].fd < 0) {
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !bots[id].connected) {
+                onConnected(id);
+                if (bots[id].fd < 0) {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT) {
+                flushBot(id);
+                if (bots[id].output.empty()) {
+                    // Only watches for writability again when a send comes up short
+                    epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.u32 = id;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, bots[id].fd, &ev);
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                readBot(id);
+            }
+        }
+    }
+
+    // --------- Report ---------
+
+    double run_s = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "\n--- RESULTS (" << run_s << "s) ---" << std::endl;
+    std::cout << "  rounds: " << round_results / 2 << " (" << (uint64_t)(round_results / 2 / run_s) << "/sec)" << std::endl;
+    std::cout << "  matches finished: " << matches_finished / 2 << std::endl;
+    std::cout << "  connect failures: " << connect_failures << ", disconnects: " << disconnects << std::endl;
+    match_latency.report();
+    join_latency.report();
+    choice_latency.report();
+    ready_latency.report();
+
+    for (int id = 0; id < (int)bots.size(); id++) {
+        closeBot(id);
+    }
+    close(epoll_fd);
+    return 0;
+}
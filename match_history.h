@@ -0,0 +1,71 @@
+/*
+Rock-Paper-Scissors Match History Format
+
+Written by game_server.cpp (--history FILE), read by history_reader.cpp.
+
+FILE        header, then fixed-size HistoryRecords, append only. A torn
+            record at the end (crash mid-write) is cut off on the next open.
+FILE.names  name table: header, then one entry per player name,
+            [u16 length][bytes]. A name's id is its position (0, 1, ...),
+            records refer to players by id only.
+
+Both files are in host byte order.
+
+*/
+
+#ifndef MATCH_HISTORY_H
+#define MATCH_HISTORY_H
+
+#include <cstdint>
+#include <cstring>
+
+struct HistoryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(HistoryRecord) for the records file, 0 for names
+};
+
+const char HISTORY_MAGIC[8] = {'R', 'P', 'S', 'H', 'I', 'S', 'T', '1'};
+const char HISTORY_NAMES_MAGIC[8] = {'R', 'P', 'S', 'N', 'A', 'M', 'E', '1'};
+const uint32_t HISTORY_VERSION = 1;
+
+enum HistoryType : uint8_t {
+    HIST_ROUND = 1,             // one round resolved
+    HIST_MATCH = 2,             // match decided (last round, or a forfeit)
+};
+
+// HIST_MATCH flags
+const uint8_t HIST_FORFEIT = 0x01;          // ended early, the other player wins
+const uint8_t HIST_FORFEIT_P1 = 0x02;       // player1 forfeited (else player2)
+const uint8_t HIST_FORFEIT_TIMEOUT = 0x04;  // by a timeout (else a disconnect)
+const uint8_t HIST_INTERRUPTED = 0x08;      // cut off by a server crash, no winner (scores as recovered)
+
+struct HistoryRecord {
+    uint64_t timestamp_us;      // wall clock, microseconds since the epoch
+    uint64_t match_id;          // same for all records of one match
+    uint32_t player1;           // name ids
+    uint32_t player2;
+    uint8_t type;               // HistoryType
+    uint8_t choice1;            // 1 rock, 2 paper, 3 scissors (0 in HIST_MATCH)
+    uint8_t choice2;
+    uint8_t score1;             // after this round
+    uint8_t score2;
+    uint8_t flags;
+    uint16_t round;             // 1-based (rounds played, in HIST_MATCH)
+};
+static_assert(sizeof(HistoryRecord) == 32, "HistoryRecord is a fixed on-disk size");
+
+inline HistoryHeader makeHistoryHeader(const char* magic, uint32_t record_size) {
+    HistoryHeader header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = HISTORY_VERSION;
+    header.record_size = record_size;
+    return header;
+}
+
+inline bool checkHistoryHeader(const HistoryHeader& header, const char* magic, uint32_t record_size) {
+    return memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+           header.version == HISTORY_VERSION && header.record_size == record_size;
+}
+
+#endif
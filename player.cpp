@@ -86,6 +86,8 @@ int main() {
     std::getline(std::cin, username);
 
     // Sends the username to server
+    // (the server reads line by line, so every message ends with '\n')
+    username += "\n";
     send(sock_fd, username.c_str(), username.length(), 0);
 
     std::cout << "Start chatting (type 'quit' to exit):\n" << std::endl;
@@ -111,6 +113,7 @@ int main() {
 
         // Send only non-empty messages to the server
         if(!message.empty()) {
+            message += "\n";
             send(sock_fd, message.c_str(), message.length(), 0);
         }
     }